@@ -1,16 +1,45 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <sdsl/int_vector.hpp>
 
-// #define HMSEARCH_DISABLE_VERT
+// #define HMSEARCH_DISABLE_SIMD
 #define HMSEARCH_PRINT_PROGRESS
 
+#if !defined(HMSEARCH_DISABLE_SIMD) && defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+#define HMSEARCH_USE_AVX512
+#elif !defined(HMSEARCH_DISABLE_SIMD) && defined(__AVX2__)
+#define HMSEARCH_USE_AVX2
+#endif
+
+#if defined(HMSEARCH_USE_AVX512) || defined(HMSEARCH_USE_AVX2)
+#include <immintrin.h>
+#endif
+
 #define HMSEARCH_CHECK_IF(cond, msg)                    \
     do {                                                \
         if (cond) {                                     \
@@ -21,31 +50,712 @@
 
 namespace hmsearch {
 
-using signature_t = std::vector<uint32_t>;
+#ifdef HMSEARCH_USE_AVX2
+// Population counts of the four 64-bit lanes, by nibble lookups summed with SAD
+inline __m256i popcount_epi64(__m256i x) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,  //
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low_mask));
+    const __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+#endif
+
+// Key of binary symbols packed into 64-bit words from the lowest bit, read from its pos-th bit. Binary queries are
+// searched through it in place of their symbol arrays, so that they are read 64 symbols at a time.
+struct packed_bits {
+    const uint64_t* words;
+    uint32_t pos;
 
-inline bool operator==(const signature_t& x, const signature_t& y) {
-    return std::equal(x.begin(), x.end(), y.begin(), y.end());
+    uint32_t operator[](uint32_t j) const {
+        j += pos;
+        return (words[j / 64] >> (j % 64)) & 1;
+    }
+    packed_bits operator+(uint32_t j) const {
+        return packed_bits{words, pos + j};
+    }
+    // The length (<= 64) bits from the j-th one in the low bits of a word
+    uint64_t get_word(uint32_t j, uint32_t length) const {
+        j += pos;
+        const uint32_t shift = j % 64;
+        uint64_t word = words[j / 64] >> shift;
+        if (shift != 0 && 64 - shift < length) {
+            word |= words[j / 64 + 1] << (64 - shift);
+        }
+        return length < 64 ? word & ((1ULL << length) - 1) : word;
+    }
+};
+
+// The length (<= 64) symbols of a binary key from its j-th one, packed into the low bits of a word
+template <class T>
+inline uint64_t get_bits(const T* key, uint32_t j, uint32_t length) {
+    uint64_t word = 0;
+    for (uint32_t k = 0; k < length; ++k) {
+        word |= uint64_t(key[j + k]) << k;
+    }
+    return word;
 }
-inline bool operator!=(const signature_t& x, const signature_t& y) {
-    return !(x == y);
+inline uint64_t get_bits(packed_bits key, uint32_t j, uint32_t length) {
+    return key.get_word(j, length);
 }
 
+// Polynomial hash fmix(sum_k sig[k] * BASE^k) of a signature. Since the sum is linear in every element, the
+// variant of a key whose j-th element is deleted hashes to prefix_j + del_marker * BASE^j + suffix_j, and
+// prefix_j + suffix_j is the sum over the whole key minus key[j] * BASE^j. Hence all the 1-deletion variants
+// of a key are hashed in O(length) time without making their signatures.
 struct sig_hash {
-    // fnv1a
-    size_t operator()(const signature_t& sig) const {
-        static const size_t init = size_t((sizeof(size_t) == 8) ? 0xcbf29ce484222325 : 0x811c9dc5);
-        static const size_t multiplier = size_t((sizeof(size_t) == 8) ? 0x100000001b3 : 0x1000193);
-        size_t h = init;
-        for (size_t i = 0; i < sig.size(); ++i) {
-            h ^= sig[i];
-            h *= multiplier;
+    static constexpr uint64_t BASE = 0x9e3779b97f4a7c15ULL;
+    static constexpr uint64_t POS_BASE = 0xc2b2ae3d27d4eb4fULL;
+
+    // Hash of the signature key[0..length)
+    template <class T>
+    uint64_t operator()(const T* key, uint32_t length) const {
+        uint64_t h = 0, pw = 1;
+        for (uint32_t j = 0; j < length; ++j) {
+            h += uint64_t(key[j]) * pw;
+            pw *= BASE;
+        }
+        return finalize(h);
+    }
+    // Writes into out[j] the hash of the signature of key[0..length) whose j-th element is del_marker
+    template <class Key>
+    void operator()(Key key, uint32_t length, uint32_t del_marker, uint64_t* out) const {
+        uint64_t h = 0, pw = 1;
+        for (uint32_t j = 0; j < length; ++j) {
+            h += uint64_t(key[j]) * pw;
+            pw *= BASE;
+        }
+        pw = 1;
+        for (uint32_t j = 0; j < length; ++j) {
+            out[j] = finalize(h + (uint64_t(del_marker) - uint64_t(key[j])) * pw);
+            pw *= BASE;
+        }
+    }
+    // The same for a binary key read 64 symbols at a time, whose variant deleting the j-th bit is represented by
+    // the key with the bit cleared and by j: the words are summed as the symbols above, and the j-th hash takes
+    // the bit out of the sum and adds j in place of a deletion marker.
+    template <class Key>
+    void binary_variants(Key key, uint32_t length, uint64_t* out) const {
+        uint64_t h = 0, pw = 1;
+        for (uint32_t beg = 0; beg < length; beg += 64) {
+            h += get_bits(key, beg, std::min(length - beg, 64U)) * pw;
+            pw *= BASE;
+        }
+        pw = 1;
+        for (uint32_t beg = 0; beg < length; beg += 64) {
+            const uint64_t word = get_bits(key, beg, std::min(length - beg, 64U));
+            for (uint32_t j = beg; j < std::min(length, beg + 64); ++j) {
+                out[j] = finalize(h - (word & (1ULL << (j - beg))) * pw + (j + 1) * POS_BASE);
+            }
+            pw *= BASE;
         }
-        return h;
     }
     static const sig_hash& get_instance() {
         static sig_hash hasher;
         return hasher;
     }
+
+  private:
+    // fmix64 of MurmurHash3, so that the low bits can be used for table positions
+    static uint64_t finalize(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+// Calls fn(beg, end) for num_threads contiguous chunks of [0, n) in parallel
+template <class Fn>
+void parallel_for(size_t n, uint32_t num_threads, Fn fn) {
+    num_threads = std::max<uint32_t>(1, std::min<size_t>(num_threads, n));
+    if (num_threads == 1) {
+        fn(size_t(0), n);
+        return;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for (uint32_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back(fn, n * t / num_threads, n * (t + 1) / num_threads);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+}
+
+// Threads kept alive across parallel runs, so that short runs do not pay for creating threads. run(fn) calls
+// fn(t) for every t in [0, size()), t = 0 on the calling thread and the others on the threads of the pool, and
+// returns once all of them have returned. A pool serves one run at a time.
+class thread_pool {
+  public:
+    explicit thread_pool(uint32_t num_threads = 1) {
+        for (uint32_t t = 1; t < num_threads; ++t) {
+            m_threads.emplace_back([this, t] { work(t); });
+        }
+    }
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_start.notify_all();
+        for (auto& th : m_threads) {
+            th.join();
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    uint32_t size() const {
+        return m_threads.size() + 1;
+    }
+
+    template <class Fn>
+    void run(Fn&& fn) {
+        using fn_t = typename std::remove_reference<Fn>::type;
+        if (m_threads.empty()) {
+            fn(uint32_t(0));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = [](void* ctx, uint32_t t) { (*static_cast<fn_t*>(ctx))(t); };
+            m_ctx = const_cast<void*>(static_cast<const void*>(std::addressof(fn)));
+            m_num_running = m_threads.size();
+            ++m_generation;
+        }
+        m_start.notify_all();
+        fn(uint32_t(0));
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_finish.wait(lock, [&] { return m_num_running == 0; });
+    }
+
+  private:
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_finish;
+    void (*m_task)(void*, uint32_t) = nullptr;  // calls the functor of the current run at m_ctx
+    void* m_ctx = nullptr;
+    uint64_t m_generation = 0;  // number of runs started
+    uint32_t m_num_running = 0;
+    bool m_stop = false;
+
+    void work(uint32_t t) {
+        for (uint64_t generation = 0;;) {
+            void (*task)(void*, uint32_t) = nullptr;
+            void* ctx = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_start.wait(lock, [&] { return m_stop || m_generation != generation; });
+                if (m_stop) {
+                    return;
+                }
+                generation = m_generation;
+                task = m_task;
+                ctx = m_ctx;
+            }
+            task(ctx, t);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_num_running == 0) {
+                    m_finish.notify_one();
+                }
+            }
+        }
+    }
+};
+
+// Stable LSD radix sort on the 64-bit keys given by key_fn, 8 bits per pass.
+// Each pass counts and scatters num_threads contiguous chunks in parallel, on the threads of pool if given.
+template <class T, class KeyFn>
+void parallel_radix_sort(std::vector<T>& vec, KeyFn key_fn, uint32_t num_threads, thread_pool* pool = nullptr) {
+    static constexpr uint32_t RADIX_BITS = 8;
+    static constexpr uint32_t RADIX_SIZE = 1U << RADIX_BITS;
+
+    const size_t n = vec.size();
+    num_threads = std::max<uint32_t>(1, std::min<size_t>(pool ? pool->size() : num_threads, n / (1U << 16) + 1));
+    auto run_chunks = [&](auto&& fn) {
+        if (pool != nullptr) {
+            pool->run([&](uint32_t t) {
+                if (t < num_threads) {
+                    fn(t);
+                }
+            });
+        } else {
+            parallel_for(num_threads, num_threads, [&](size_t t, size_t) { fn(t); });
+        }
+    };
+
+    std::vector<T> buf(n);
+    std::vector<size_t> counts(num_threads * RADIX_SIZE);
+
+    for (uint32_t shift = 0; shift < 64; shift += RADIX_BITS) {
+        std::fill(counts.begin(), counts.end(), 0);
+        run_chunks([&](size_t t) {
+            size_t* cnt = &counts[t * RADIX_SIZE];
+            for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i) {
+                ++cnt[(key_fn(vec[i]) >> shift) & (RADIX_SIZE - 1)];
+            }
+        });
+
+        // exclusive prefix sums in (digit, thread) order keep the sort stable
+        bool skip = false;
+        size_t offset = 0;
+        for (uint32_t d = 0; d < RADIX_SIZE; ++d) {
+            const size_t digit_beg = offset;
+            for (uint32_t t = 0; t < num_threads; ++t) {
+                const size_t c = counts[t * RADIX_SIZE + d];
+                counts[t * RADIX_SIZE + d] = offset;
+                offset += c;
+            }
+            if (offset - digit_beg == n) {
+                skip = true;  // all keys share this digit
+            }
+        }
+        if (skip) {
+            continue;
+        }
+
+        run_chunks([&](size_t t) {
+            size_t* pos = &counts[t * RADIX_SIZE];
+            for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i) {
+                buf[pos[(key_fn(vec[i]) >> shift) & (RADIX_SIZE - 1)]++] = vec[i];
+            }
+        });
+        vec.swap(buf);
+    }
+}
+
+// Allocator returning memory aligned to Align bytes (e.g., cache lines)
+template <class T, size_t Align>
+struct aligned_allocator {
+    using value_type = T;
+    template <class U>
+    struct rebind {
+        using other = aligned_allocator<U, Align>;
+    };
+
+    aligned_allocator() = default;
+    template <class U>
+    aligned_allocator(const aligned_allocator<U, Align>&) {}
+
+    T* allocate(size_t n) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, Align, std::max<size_t>(n * sizeof(T), 1)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) {
+        free(ptr);
+    }
+
+    template <class U>
+    bool operator==(const aligned_allocator<U, Align>&) const {
+        return true;
+    }
+    template <class U>
+    bool operator!=(const aligned_allocator<U, Align>&) const {
+        return false;
+    }
+};
+
+template <class T>
+using cache_aligned_vector = std::vector<T, aligned_allocator<T, 64>>;
+
+// Read-only mapping of a whole file
+class mapped_file {
+  public:
+    explicit mapped_file(const std::string& fn) {
+        const int fd = ::open(fn.c_str(), O_RDONLY);
+        HMSEARCH_CHECK_IF(fd == -1, "open error: " << fn);
+        struct stat st;
+        HMSEARCH_CHECK_IF(::fstat(fd, &st) == -1, "fstat error: " << fn);
+        m_size = st.st_size;
+        if (m_size > 0) {
+            void* addr = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            HMSEARCH_CHECK_IF(addr == MAP_FAILED, "mmap error: " << fn);
+            m_data = static_cast<const char*>(addr);
+        }
+        ::close(fd);
+    }
+    ~mapped_file() {
+        if (m_data != nullptr) {
+            ::munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const char* data() const {
+        return m_data;
+    }
+    uint64_t size() const {
+        return m_size;
+    }
+
+  private:
+    const char* m_data = nullptr;
+    uint64_t m_size = 0;
+};
+
+// Writer of the index format, in which every array starts at a 64-byte boundary from the beginning of the
+// stream, so that a mapped index file can be used in place.
+class index_writer {
+  public:
+    static constexpr uint64_t ALIGNMENT = 64;
+
+    explicit index_writer(std::ostream& out) : m_out(out) {}
+
+    template <class T>
+    void write(const T& x) {
+        static_assert(std::is_trivially_copyable<T>::value, "");
+        write_bytes(&x, sizeof(T));
+    }
+    // Writes size and then the elements from the next aligned position
+    template <class T>
+    void write_array(const T* data, uint64_t size) {
+        static_assert(std::is_trivially_copyable<T>::value, "");
+        write(size);
+        write_bytes(nullptr, (ALIGNMENT - m_pos % ALIGNMENT) % ALIGNMENT);
+        write_bytes(data, size * sizeof(T));
+    }
+    template <class T, class Alloc>
+    void write_vector(const std::vector<T, Alloc>& vec) {
+        write_array(vec.data(), vec.size());
+    }
+
+    uint64_t written_bytes() const {
+        return m_pos;
+    }
+
+  private:
+    std::ostream& m_out;
+    uint64_t m_pos = 0;
+
+    void write_bytes(const void* data, uint64_t size) {
+        static const char zeros[ALIGNMENT] = {};
+        m_out.write(data != nullptr ? static_cast<const char*>(data) : zeros, size);
+        m_pos += size;
+    }
+};
+
+// Reader of the index format either from a stream, copying the arrays, or from a mapped file, viewing them.
+class index_reader {
+  public:
+    explicit index_reader(std::istream& in) : m_in(&in) {}
+    explicit index_reader(std::shared_ptr<const mapped_file> file) : m_file(std::move(file)) {}
+
+    template <class T>
+    void read(T& x) {
+        static_assert(std::is_trivially_copyable<T>::value, "");
+        read_bytes(&x, sizeof(T));
+    }
+    // Reads an array written by index_writer::write_array and returns its elements, which are in the mapped
+    // file or otherwise copied into buf.
+    template <class T, class Alloc>
+    const T* read_array(std::vector<T, Alloc>& buf, uint64_t& size) {
+        read(size);
+        read_bytes(nullptr, (index_writer::ALIGNMENT - m_pos % index_writer::ALIGNMENT) % index_writer::ALIGNMENT);
+        if (!m_file) {
+            buf.resize(size);
+            read_bytes(buf.data(), size * sizeof(T));
+            return buf.data();
+        }
+        buf = std::vector<T, Alloc>();
+        const T* data = reinterpret_cast<const T*>(m_file->data() + m_pos);
+        read_bytes(nullptr, size * sizeof(T));
+        return data;
+    }
+    template <class T, class Alloc>
+    void read_vector(std::vector<T, Alloc>& vec) {
+        uint64_t size = 0;
+        const T* data = read_array(vec, size);
+        if (data != vec.data()) {
+            vec.assign(data, data + size);
+        }
+    }
+
+    const std::shared_ptr<const mapped_file>& get_file() const {
+        return m_file;
+    }
+
+  private:
+    std::istream* m_in = nullptr;
+    std::shared_ptr<const mapped_file> m_file;
+    uint64_t m_pos = 0;
+
+    // Skips size bytes if data is null
+    void read_bytes(void* data, uint64_t size) {
+        if (m_file) {
+            HMSEARCH_CHECK_IF(m_pos + size > m_file->size(), "index file is truncated.");
+            if (data != nullptr) {
+                std::memcpy(data, m_file->data() + m_pos, size);
+            }
+        } else if (data != nullptr) {
+            m_in->read(static_cast<char*>(data), size);
+        } else {
+            m_in->ignore(size);
+        }
+        m_pos += size;
+    }
+};
+
+// Read-only array of trivially copyable elements that either owns them or views them in a mapped file
+template <class T, class Alloc = std::allocator<T>>
+class pod_array {
+  public:
+    pod_array() = default;
+    pod_array(std::vector<T, Alloc>&& vec) : m_vec(std::move(vec)), m_data(m_vec.data()), m_size(m_vec.size()) {}
+
+    pod_array(const pod_array& other) : m_vec(other.m_vec), m_file(other.m_file), m_size(other.m_size) {
+        m_data = m_file ? other.m_data : m_vec.data();
+    }
+    pod_array(pod_array&& other) noexcept
+        : m_vec(std::move(other.m_vec)), m_file(std::move(other.m_file)), m_data(other.m_data), m_size(other.m_size) {
+        other.m_data = nullptr;
+        other.m_size = 0;
+    }
+    pod_array& operator=(pod_array other) noexcept {
+        std::swap(m_vec, other.m_vec);
+        std::swap(m_file, other.m_file);
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+
+    void write(index_writer& out) const {
+        out.write_array(m_data, m_size);
+    }
+    void read(index_reader& in) {
+        m_data = in.read_array(m_vec, m_size);
+        m_file = in.get_file();
+    }
+
+    const T& operator[](uint64_t i) const {
+        return m_data[i];
+    }
+    const T* data() const {
+        return m_data;
+    }
+    // Elements of an owned array, to be filled in place
+    T* mutable_data() {
+        assert(!m_file);
+        return m_vec.data();
+    }
+    const T* begin() const {
+        return m_data;
+    }
+    const T* end() const {
+        return m_data + m_size;
+    }
+    uint64_t size() const {
+        return m_size;
+    }
+    bool empty() const {
+        return m_size == 0;
+    }
+
+  private:
+    std::vector<T, Alloc> m_vec;
+    std::shared_ptr<const mapped_file> m_file;
+    const T* m_data = nullptr;
+    uint64_t m_size = 0;
+};
+
+// Array of width-bit integers with the ownership of pod_array, where set() is only for owned arrays
+class packed_array {
+  public:
+    packed_array() = default;
+    packed_array(uint64_t size, uint32_t width)
+        : m_words(std::vector<uint64_t>((size * width + 63) / 64, 0)), m_size(size), m_width(width) {}
+
+    void write(index_writer& out) const {
+        out.write(m_size);
+        out.write(m_width);
+        m_words.write(out);
+    }
+    void read(index_reader& in) {
+        in.read(m_size);
+        in.read(m_width);
+        m_words.read(in);
+    }
+
+    uint64_t operator[](uint64_t i) const {
+        const uint64_t bit = i * m_width;
+        return sdsl::bits::read_int(m_words.data() + (bit >> 6), bit & 63, m_width);
+    }
+    // The length (<= 64) integers from the i-th one of a 1-bit array, in the low bits of a word
+    uint64_t get_bits(uint64_t i, uint32_t length) const {
+        assert(m_width == 1 && length <= 64);
+        return sdsl::bits::read_int(m_words.data() + (i >> 6), i & 63, length);
+    }
+    void set(uint64_t i, uint64_t x) {
+        const uint64_t bit = i * m_width;
+        sdsl::bits::write_int(m_words.mutable_data() + (bit >> 6), x, bit & 63, m_width);
+    }
+    uint64_t size() const {
+        return m_size;
+    }
+    uint32_t width() const {
+        return m_width;
+    }
+    void prefetch(uint64_t i) const {
+        __builtin_prefetch(m_words.data() + ((i * m_width) >> 6));
+    }
+
+  private:
+    pod_array<uint64_t> m_words;
+    uint64_t m_size = 0;
+    uint32_t m_width = 0;
+};
+
+enum class table_layout : uint32_t {
+    LINEAR_PROBING,     // open addressing with linear probing at load factor 1/1.5
+    BUCKETIZED_CUCKOO,  // two-choice cuckoo hashing over 64-byte buckets, at most two cache lines per lookup
+};
+
+// Construction options
+// HORIZONTAL packs the symbols of each key and compares them one by one, while VERTICAL splits the keys into bit
+// planes and counts mismatches with popcounts over 64 symbols at a time. AUTO picks one by the alphabet size.
+enum class key_layout : uint32_t { AUTO, HORIZONTAL, VERTICAL };
+
+struct build_config {
+    // If false, odv_index does not keep the signatures of variants shared by two or more keys, and a table hit is
+    // verified by comparing the query with the first key of the posting list, as is always done for single-id lists.
+    bool store_signatures = true;
+    // Hash table of the variants in odv_index
+    table_layout layout = table_layout::LINEAR_PROBING;
+    // If true, odv_index stores posting lists with posting_codec instead of raw 32-bit ids
+    bool compress_postings = false;
+    // Layout of the key codes by which hm_index verifies candidates
+    key_layout keys = key_layout::AUTO;
+};
+
+// Byte-aligned encoding of a strictly increasing id list:
+//   varint(size << 1 | is_bitmap), varint(first id), and then either
+//   - a bitmap: varint(bytes) followed by bytes whose k-th bit tells if first + 1 + k is in the list, or
+//   - gaps: blocks of up to BLOCK_SIZE values (id - prev_id - 1), each a byte of bit width followed by
+//     the values packed with that width.
+// The encoded stream must be followed by PADDING bytes so that packed values are read by 8-byte loads.
+struct posting_codec {
+    static constexpr uint32_t BLOCK_SIZE = 128;
+    static constexpr uint32_t PADDING = 8;
+
+    static void encode(const uint32_t* ids, size_t size, std::vector<uint8_t>& out) {
+        assert(size > 0);
+
+        const uint64_t bitmap_bytes = (uint64_t(ids[size - 1]) - ids[0] + 7) / 8;
+        uint64_t packed_bytes = 0;
+        for (size_t beg = 1; beg < size; beg += BLOCK_SIZE) {
+            const size_t end = std::min<size_t>(beg + BLOCK_SIZE, size);
+            packed_bytes += 1 + ((end - beg) * gap_width(ids, beg, end) + 7) / 8;
+        }
+
+        const bool is_bitmap = bitmap_bytes < packed_bytes;
+        write_varint((uint64_t(size) << 1) | is_bitmap, out);
+        write_varint(ids[0], out);
+
+        if (is_bitmap) {
+            write_varint(bitmap_bytes, out);
+            const size_t offset = out.size();
+            out.resize(offset + bitmap_bytes, 0);
+            for (size_t i = 1; i < size; ++i) {
+                const uint64_t k = ids[i] - ids[0] - 1;
+                out[offset + k / 8] |= uint8_t(1U << (k % 8));
+            }
+            return;
+        }
+
+        for (size_t beg = 1; beg < size; beg += BLOCK_SIZE) {
+            const size_t end = std::min<size_t>(beg + BLOCK_SIZE, size);
+            const uint32_t width = gap_width(ids, beg, end);
+            out.push_back(uint8_t(width));
+            const size_t offset = out.size();
+            out.resize(offset + ((end - beg) * width + 7) / 8, 0);
+            for (size_t i = beg; i < end; ++i) {
+                const uint64_t gap = ids[i] - ids[i - 1] - 1;
+                const uint64_t bit_pos = (i - beg) * width;
+                for (uint32_t b = 0; b < width; ++b) {
+                    if ((gap >> b) & 1ULL) {
+                        out[offset + (bit_pos + b) / 8] |= uint8_t(1U << ((bit_pos + b) % 8));
+                    }
+                }
+            }
+        }
+    }
+
+    static uint32_t first(const uint8_t* in) {
+        read_varint(in);
+        return static_cast<uint32_t>(read_varint(in));
+    }
+
+    // Calls fn(id) for each id of the list encoded at in
+    template <class Fn>
+    static void decode(const uint8_t* in, Fn&& fn) {
+        const uint64_t header = read_varint(in);
+        const uint64_t size = header >> 1;
+        uint32_t id = static_cast<uint32_t>(read_varint(in));
+        fn(id);
+
+        if (header & 1ULL) {  // bitmap
+            const uint64_t bytes = read_varint(in);
+            for (uint64_t i = 0; i < bytes; ++i) {
+                for (uint32_t bits = in[i]; bits != 0; bits &= bits - 1) {
+                    fn(id + 1 + uint32_t(i * 8) + uint32_t(__builtin_ctz(bits)));
+                }
+            }
+            return;
+        }
+
+        for (uint64_t beg = 1; beg < size; beg += BLOCK_SIZE) {
+            const uint64_t end = std::min<uint64_t>(beg + BLOCK_SIZE, size);
+            const uint32_t width = *in++;
+            const uint64_t mask = sdsl::bits::lo_set[width];
+            for (uint64_t i = 0; i < end - beg; ++i) {
+                const uint64_t bit_pos = i * width;
+                uint64_t word;
+                std::memcpy(&word, in + bit_pos / 8, sizeof(word));
+                id += uint32_t((word >> (bit_pos % 8)) & mask) + 1;
+                fn(id);
+            }
+            in += ((end - beg) * width + 7) / 8;
+        }
+    }
+
+  private:
+    static uint32_t gap_width(const uint32_t* ids, size_t beg, size_t end) {
+        uint32_t max_gap = 0;
+        for (size_t i = beg; i < end; ++i) {
+            max_gap = std::max(max_gap, ids[i] - ids[i - 1] - 1);
+        }
+        return max_gap == 0 ? 0 : sdsl::bits::hi(max_gap) + 1;
+    }
+
+    static void write_varint(uint64_t x, std::vector<uint8_t>& out) {
+        while (x >= 0x80) {
+            out.push_back(uint8_t(x | 0x80));
+            x >>= 7;
+        }
+        out.push_back(uint8_t(x));
+    }
+    static uint64_t read_varint(const uint8_t*& in) {
+        uint64_t x = 0;
+        for (uint32_t shift = 0;; shift += 7) {
+            const uint8_t b = *in++;
+            x |= uint64_t(b & 0x7F) << shift;
+            if (b < 0x80) {
+                return x;
+            }
+        }
+    }
 };
 
 #ifdef HMSEARCH_PRINT_PROGRESS
@@ -83,17 +793,51 @@ class odv_index {
 
   private:
     static constexpr float LOAD_FACTOR = 1.5;
+    static constexpr float CUCKOO_LOAD_FACTOR = 0.95;
+    static constexpr uint32_t CUCKOO_SLOTS = 8;
+    static constexpr uint32_t CUCKOO_MAX_KICKS = 500;
+    static constexpr uint32_t VACANT = UINT32_MAX;
+    static constexpr uint32_t SINGLETON_FLAG = 1U << 31;
+    static constexpr uint32_t FORMAT_VERSION = 4;
+    static constexpr uint64_t NOT_FOUND = UINT64_MAX;
+
+    // 1-deletion variant of keys[id] whose pos-th element is deleted
+    struct variant_t {
+        uint64_t hash;
+        uint32_t id;
+        uint32_t pos;
+    };
 
-    struct element_t {
-        uint32_t sig_pos;
-        uint32_t id_beg;
-        uint32_t id_end;
+    // Lists of two or more ids are stored in rank order, so that the rank-th list is
+    // m_ids[m_offsets[rank]..m_offsets[rank + 1]) (or the posting_codec record at m_postings[m_offsets[rank]])
+    // and its signature, if stored, is the rank-th one in m_signatures. A binary signature is stored in one bit
+    // per symbol with the deleted bit cleared, since the deleted position is told by the fingerprint.
+    struct slot_t {
+        uint32_t fingerprint;  // upper hash bits and deleted position of the variant, or VACANT
+        uint32_t ref;          // rank of the list, or its only id tagged with SINGLETON_FLAG
     };
-    std::vector<element_t> m_table;
-    std::vector<uint32_t> m_ids;
-    sdsl::int_vector<> m_signatures;
+    struct alignas(64) cuckoo_bucket_t {
+        slot_t slots[CUCKOO_SLOTS];
+    };
+    static_assert(sizeof(cuckoo_bucket_t) == 64, "");
+
+    // slot to be placed and its variant hash
+    struct entry_t {
+        uint64_t hash;
+        slot_t slot;
+    };
+
+    pod_array<slot_t> m_table;
+    pod_array<cuckoo_bucket_t, aligned_allocator<cuckoo_bucket_t, 64>> m_cuckoo_table;
+    pod_array<uint32_t> m_offsets;
+    pod_array<uint32_t> m_ids;
+    pod_array<uint8_t> m_postings;  // posting_codec stream used instead of m_ids
+    packed_array m_signatures;
     uint32_t m_length = 0;
     uint32_t m_del_marker = 0;
+    bool m_store_signatures = true;
+    table_layout m_layout = table_layout::LINEAR_PROBING;
+    bool m_compress_postings = false;
 
   public:
     odv_index() = default;
@@ -101,197 +845,905 @@ class odv_index {
 
     size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
         auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
-        size_type written_bytes = 0;
-        written_bytes += sdsl::serialize(m_table, out);
-        written_bytes += sdsl::serialize(m_ids, out);
-        written_bytes += sdsl::serialize(m_signatures, out);
-        written_bytes += sdsl::serialize(m_length, out);
-        written_bytes += sdsl::serialize(m_del_marker, out);
-        sdsl::structure_tree::add_size(child, written_bytes);
-        return written_bytes;
+        index_writer writer(out);
+        write(writer);
+        sdsl::structure_tree::add_size(child, writer.written_bytes());
+        return writer.written_bytes();
     }
 
     void load(std::istream& in) {
-        sdsl::load(m_table, in);
-        sdsl::load(m_ids, in);
-        sdsl::load(m_signatures, in);
-        sdsl::load(m_length, in);
-        sdsl::load(m_del_marker, in);
+        index_reader reader(in);
+        read(reader);
+    }
+
+    void write(index_writer& out) const {
+        out.write(uint32_t(FORMAT_VERSION));
+        out.write(m_length);
+        out.write(m_del_marker);
+        out.write(m_store_signatures);
+        out.write(m_layout);
+        out.write(m_compress_postings);
+        m_table.write(out);
+        m_cuckoo_table.write(out);
+        m_offsets.write(out);
+        m_ids.write(out);
+        m_postings.write(out);
+        m_signatures.write(out);
+    }
+
+    void read(index_reader& in) {
+        uint32_t version = 0;
+        in.read(version);
+        HMSEARCH_CHECK_IF(version != FORMAT_VERSION, "unsupported format of odv_index.");
+        in.read(m_length);
+        in.read(m_del_marker);
+        in.read(m_store_signatures);
+        in.read(m_layout);
+        in.read(m_compress_postings);
+        m_table.read(in);
+        m_cuckoo_table.read(in);
+        m_offsets.read(in);
+        m_ids.read(in);
+        m_postings.read(in);
+        m_signatures.read(in);
+    }
+
+    bool stores_signatures() const {
+        return m_store_signatures;
+    }
+    // Binary variants are hashed and compared 64 symbols at a time
+    bool is_binary() const {
+        return m_del_marker <= 2;
+    }
+
+    build_config get_config() const {
+        build_config config;
+        config.store_signatures = m_store_signatures;
+        config.layout = m_layout;
+        config.compress_postings = m_compress_postings;
+        return config;
     }
 
     template <class T>
-    void build(const std::vector<const T*>& keys, uint32_t length, uint32_t alphabet_size) {
+    void build(const std::vector<const T*>& keys, uint32_t length, uint32_t alphabet_size, uint32_t num_threads = 1,
+               bool print_progress = true, const build_config& config = build_config()) {
         static_assert(sizeof(T) <= 4, "");
 
         HMSEARCH_CHECK_IF(alphabet_size == UINT32_MAX, "alphabet_size is too large.");
-        HMSEARCH_CHECK_IF(keys.size() * m_length > UINT32_MAX, "size of ids exceeds.");
+        HMSEARCH_CHECK_IF(keys.size() * length > UINT32_MAX, "size of ids exceeds.");
+        HMSEARCH_CHECK_IF(keys.size() >= SINGLETON_FLAG, "number of keys exceeds 2^31.");
 
         m_length = length;
         m_del_marker = alphabet_size;
+        m_store_signatures = config.store_signatures;
+        m_layout = config.layout;
+        m_compress_postings = config.compress_postings;
 
-        std::unordered_map<signature_t, std::vector<uint32_t>, sig_hash> signature_map;
+        // Every 1-deletion variant is emitted as a flat (hash, id, pos) record and the records are sorted by hash,
+        // so that identical variants form consecutive runs whose ids are in increasing order.
+        std::vector<variant_t> variants(keys.size() * m_length);
         {
 #ifdef HMSEARCH_PRINT_PROGRESS
-            std::cerr << " #    - Making signatures... " << std::flush;
-            progress_printer p(keys.size() - 1);
+            if (print_progress) {
+                std::cerr << " #    - Making signatures..." << std::flush;
+            }
 #endif
-            signature_t sig(m_length);
-            for (uint32_t i = 0; i < keys.size(); ++i) {
-                for (uint32_t j = 0; j < m_length; ++j) {
-                    HMSEARCH_CHECK_IF(keys[i][j] >= alphabet_size, "keys include a large character.");
-
-                    make_signature(keys[i], j, sig);
-
-                    auto it = signature_map.find(sig);
-                    if (it != signature_map.end()) {
-                        it->second.push_back(i);
-                    } else {
-                        signature_map.insert(std::make_pair(sig, std::vector<uint32_t>{i}));
+            parallel_for(keys.size(), num_threads, [&](size_t beg, size_t end) {
+                std::vector<uint64_t> hashes(m_length);
+                for (size_t i = beg; i < end; ++i) {
+                    hash_variants(keys[i], hashes.data());
+                    for (uint32_t j = 0; j < m_length; ++j) {
+                        HMSEARCH_CHECK_IF(keys[i][j] >= alphabet_size, "keys include a large character.");
+                        variants[i * m_length + j] = variant_t{hashes[j], uint32_t(i), j};
                     }
                 }
+            });
 #ifdef HMSEARCH_PRINT_PROGRESS
-                p(i);
+            if (print_progress) {
+                std::cerr << " done!!" << std::endl;
+                std::cerr << " #    - Sorting signatures..." << std::flush;
+            }
 #endif
+            parallel_radix_sort(variants, [](const variant_t& v) { return v.hash; }, num_threads);
+#ifdef HMSEARCH_PRINT_PROGRESS
+            if (print_progress) {
+                std::cerr << " done!!" << std::endl;
             }
+#endif
         }
 
-        HMSEARCH_CHECK_IF(signature_map.size() > UINT32_MAX, "number of signatures exceeds UINT32_MAX.");
+        // Split hash runs into runs of identical variants (they differ only on hash collisions)
+        auto variant_less = [&](const variant_t& x, const variant_t& y) {
+            if (x.pos != y.pos) {
+                return x.pos < y.pos;
+            }
+            for (uint32_t j = 0; j < m_length; ++j) {
+                if (j != x.pos && keys[x.id][j] != keys[y.id][j]) {
+                    return keys[x.id][j] < keys[y.id][j];
+                }
+            }
+            return false;
+        };
+        auto variant_equal = [&](const variant_t& x, const variant_t& y) {
+            return x.hash == y.hash && !variant_less(x, y) && !variant_less(y, x);
+        };
+
+        size_t num_signatures = 0;
+        size_t num_shared_signatures = 0;  // variants with two or more ids
+        size_t num_shared_ids = 0;
+        for (size_t run_beg = 0; run_beg < variants.size();) {
+            size_t run_end = run_beg + 1;
+            bool collided = false;
+            while (run_end < variants.size() && variants[run_end].hash == variants[run_beg].hash) {
+                collided = collided || !variant_equal(variants[run_beg], variants[run_end]);
+                ++run_end;
+            }
+            if (collided) {
+                std::stable_sort(variants.begin() + run_beg, variants.begin() + run_end, variant_less);
+            }
+            size_t group_beg = run_beg;
+            for (size_t i = run_beg + 1; i <= run_end; ++i) {
+                if (i == run_end || !variant_equal(variants[i - 1], variants[i])) {
+                    ++num_signatures;
+                    if (i - group_beg > 1) {
+                        ++num_shared_signatures;
+                        num_shared_ids += i - group_beg;
+                    }
+                    group_beg = i;
+                }
+            }
+            run_beg = run_end;
+        }
 
-        const size_t table_size = static_cast<size_t>(signature_map.size() * LOAD_FACTOR);
-        m_table.resize(table_size, element_t{UINT32_MAX, 0, 0});
-        m_ids.reserve(keys.size() * m_length);
-        m_signatures = sdsl::int_vector<>(signature_map.size() * m_length, 0, sdsl::bits::hi(alphabet_size) + 1);
+        HMSEARCH_CHECK_IF(num_signatures > UINT32_MAX, "number of signatures exceeds UINT32_MAX.");
+
+        std::vector<uint32_t> offsets(1, 0);
+        offsets.reserve(num_shared_signatures + 1);
+        std::vector<uint32_t> id_lists;
+        id_lists.reserve(m_compress_postings ? 0 : num_shared_ids);
+        std::vector<uint8_t> postings;
+        if (m_store_signatures) {
+            m_signatures = packed_array(num_shared_signatures * m_length,
+                                        is_binary() ? 1 : sdsl::bits::hi(alphabet_size) + 1);
+        } else {
+            m_signatures = packed_array();
+        }
 
 #ifdef HMSEARCH_PRINT_PROGRESS
-        std::cerr << " #    - Storing signatures..." << std::flush;
-        uint32_t progress = 0;
-        progress_printer p(signature_map.size() - 1);
+        if (print_progress) {
+            std::cerr << " #    - Storing signatures..." << std::flush;
+        }
+        progress_printer p(variants.size() - 1);
 #endif
 
-        uint64_t sig_beg = 0;
+        std::vector<entry_t> entries;
+        entries.reserve(num_signatures);
 
-        for (const auto& kv : signature_map) {
-            const signature_t& sig = kv.first;
-            const std::vector<uint32_t>& ids = kv.second;
+        std::vector<uint32_t> ids;
 
-            uint64_t pos = sig_hash::get_instance()(sig) % table_size;
+        for (size_t id_beg = 0; id_beg < variants.size();) {
+            const variant_t& v = variants[id_beg];
 
-            while (true) {
-                if (m_table[pos].sig_pos == UINT32_MAX) {  // vacant?
-                    m_table[pos].sig_pos = sig_beg / m_length;
-                    std::copy(sig.begin(), sig.end(), m_signatures.begin() + sig_beg);
-                    sig_beg += m_length;  // sig.size()
+            size_t id_end = id_beg + 1;
+            while (id_end < variants.size() && variant_equal(v, variants[id_end])) {
+                ++id_end;
+            }
 
-                    m_table[pos].id_beg = m_ids.size();
-                    std::copy(ids.begin(), ids.end(), std::back_inserter(m_ids));
-                    m_table[pos].id_end = m_ids.size();
+            slot_t slot;
+            slot.fingerprint = make_fingerprint(v.hash, v.pos);
 
-                    break;
+            if (id_end - id_beg == 1) {
+                slot.ref = v.id | SINGLETON_FLAG;
+            } else {
+                slot.ref = offsets.size() - 1;
+
+                if (m_store_signatures) {
+                    const uint64_t sig_beg = uint64_t(slot.ref) * m_length;
+                    for (uint32_t j = 0; j < m_length; ++j) {
+                        if (j != v.pos) {
+                            m_signatures.set(sig_beg + j, keys[v.id][j]);
+                        } else if (!is_binary()) {
+                            m_signatures.set(sig_beg + j, m_del_marker);
+                        }
+                    }
                 }
 
-                ++pos;
-                if (pos == table_size) {
-                    pos = 0;
+                if (m_compress_postings) {
+                    ids.clear();
+                    for (size_t i = id_beg; i < id_end; ++i) {
+                        ids.push_back(variants[i].id);
+                    }
+                    posting_codec::encode(ids.data(), ids.size(), postings);
+                    HMSEARCH_CHECK_IF(postings.size() > UINT32_MAX, "size of postings exceeds.");
+                    offsets.push_back(postings.size());
+                } else {
+                    for (size_t i = id_beg; i < id_end; ++i) {
+                        id_lists.push_back(variants[i].id);
+                    }
+                    offsets.push_back(id_lists.size());
                 }
             }
+
+            entries.push_back(entry_t{v.hash, slot});
+
 #ifdef HMSEARCH_PRINT_PROGRESS
-            p(progress++);
+            if (print_progress) {
+                p(id_end - 1);
+            }
 #endif
+            id_beg = id_end;
         }
 
-        assert(sig_beg == m_signatures.size());
-        assert(m_ids.size() == keys.size() * m_length);
-    }
+        assert(entries.size() == num_signatures);
+        assert(offsets.size() == num_shared_signatures + 1);
+        assert(m_compress_postings || id_lists.size() == num_shared_ids);
+        variants = std::vector<variant_t>();
 
-    template <class T>
-    void search(const T* key, signature_t& sig, std::function<void(uint32_t)> fn) const {
-        sig.resize(m_length);
+        if (m_compress_postings) {
+            postings.resize(postings.size() + posting_codec::PADDING, 0);
+            postings.shrink_to_fit();
+        }
+        m_offsets = std::move(offsets);
+        m_ids = std::move(id_lists);
+        m_postings = std::move(postings);
 
-        for (uint32_t j = 0; j < m_length; ++j) {
-            make_signature(key, j, sig);
-            uint64_t pos = sig_hash::get_instance()(sig) % m_table.size();
+        m_table = pod_array<slot_t>();
+        m_cuckoo_table = pod_array<cuckoo_bucket_t, aligned_allocator<cuckoo_bucket_t, 64>>();
 
-            while (true) {
-                if (m_table[pos].sig_pos == UINT32_MAX) {  // vacant?
-                    break;
-                }
+        if (m_layout == table_layout::BUCKETIZED_CUCKOO && !entries.empty()) {
+            size_t num_buckets = std::ceil(num_signatures / (CUCKOO_SLOTS * CUCKOO_LOAD_FACTOR));
+            while (!place_cuckoo(entries, std::max<size_t>(num_buckets, 1))) {
+                num_buckets += num_buckets / 32 + 1;
+            }
+        } else if (m_layout == table_layout::LINEAR_PROBING) {
+            place_linear(entries);
+        }
+    }
+
+    // Working memory of search
+    struct search_scratch {
+        std::vector<uint64_t> hashes;  // variant hashes of the key, left for the caller after search
+        std::vector<uint64_t> probes;  // first slot matching the fingerprint of each variant, or NOT_FOUND
+    };
+
+    // fn(id) is called for every id on the hit lists. verify(id, j) must tell whether the id-th key equals key
+    // except for the j-th element; it resolves hits on single-id lists, and on all the lists if signatures are not
+    // stored. Both are template functors so that the calls per posting id inline into the caller's loop.
+    // The variants are probed in three passes so that their cache misses overlap instead of adding up: the home
+    // slots of all the variants are prefetched, then the slots matching their fingerprints are located and the
+    // signatures and lists they refer to are prefetched, and finally the hits are verified and reported.
+    // The passes are also exposed one by one, so that the caller can interleave them across queries.
+    template <class Key, class Fn, class Verify>
+    void search(Key key, search_scratch& scratch, Fn&& fn, Verify&& verify) const {
+        prefetch_variants(key, scratch);
+        locate_variants(scratch);
+        report_variants(key, scratch, fn, verify);
+    }
 
-                const uint64_t sig_beg = m_table[pos].sig_pos * m_length;
+    template <class Key>
+    void prefetch_variants(Key key, search_scratch& scratch) const {
+        std::vector<uint64_t>& hashes = scratch.hashes;
+        hashes.resize(m_length);
+        hash_variants(key, hashes.data());
 
-                if (std::equal(sig.begin(), sig.end(), m_signatures.begin() + sig_beg)) {
-                    for (uint32_t i = m_table[pos].id_beg; i < m_table[pos].id_end; ++i) {
-                        fn(m_ids[i]);
+        if (empty_table()) {
+            return;
+        }
+        for (uint32_t j = 0; j < m_length; ++j) {
+            prefetch_home(hashes[j]);
+        }
+    }
+
+    void locate_variants(search_scratch& scratch) const {
+        const std::vector<uint64_t>& hashes = scratch.hashes;
+        std::vector<uint64_t>& probes = scratch.probes;
+        probes.assign(m_length, uint64_t(NOT_FOUND));
+
+        if (empty_table()) {
+            return;
+        }
+        for (uint32_t j = 0; j < m_length; ++j) {
+            probes[j] = find_fingerprint(hashes[j], make_fingerprint(hashes[j], j));
+            if (probes[j] != NOT_FOUND) {
+                prefetch_refs(get_slot(hashes[j], probes[j]));
+            }
+        }
+    }
+
+    template <class Key, class Fn, class Verify>
+    void report_variants(Key key, const search_scratch& scratch, Fn&& fn, Verify&& verify) const {
+        const std::vector<uint64_t>& hashes = scratch.hashes;
+        const std::vector<uint64_t>& probes = scratch.probes;
+
+        for (uint32_t j = 0; j < m_length; ++j) {
+            if (probes[j] == NOT_FOUND) {
+                continue;
+            }
+            const slot_t* slot = find_variant(hashes[j], probes[j], make_fingerprint(hashes[j], j), key, j, verify);
+            if (slot != nullptr) {
+                report_list(*slot, fn);
+            }
+        }
+    }
+
+    // Writes into out[j] the hash of the variant of key whose j-th element is deleted
+    template <class Key>
+    void hash_variants(Key key, uint64_t* out) const {
+        if (is_binary()) {
+            sig_hash::get_instance().binary_variants(key, m_length, out);
+        } else {
+            sig_hash::get_instance()(key, m_length, m_del_marker, out);
+        }
+    }
+
+    // Position of the home slot of a variant hash, or of its first bucket for the cuckoo table
+    uint64_t get_home(uint64_t hash) const {
+        if (empty_table()) {
+            return 0;
+        }
+        if (m_layout == table_layout::LINEAR_PROBING) {
+            return hash % m_table.size();
+        }
+        return cuckoo_first_bucket(hash, m_cuckoo_table.size());
+    }
+
+    // Checks if no variant is stored, as when the index is built from no keys
+    bool empty_table() const {
+        return m_layout == table_layout::LINEAR_PROBING ? m_table.empty() : m_cuckoo_table.empty();
+    }
+
+    // Looks up the single variant of key whose j-th element is deleted and whose hash is given
+    template <class Key, class Fn, class Verify>
+    void search_variant(Key key, uint64_t hash, uint32_t j, Fn&& fn, Verify&& verify) const {
+        if (empty_table()) {
+            return;
+        }
+        const uint32_t fingerprint = make_fingerprint(hash, j);
+        const uint64_t probe = find_fingerprint(hash, fingerprint);
+        if (probe == NOT_FOUND) {
+            return;
+        }
+        const slot_t* slot = find_variant(hash, probe, fingerprint, key, j, verify);
+        if (slot != nullptr) {
+            report_list(*slot, fn);
+        }
+    }
+
+  private:
+    void place_linear(const std::vector<entry_t>& entries) {
+        const size_t table_size = static_cast<size_t>(entries.size() * LOAD_FACTOR);
+        std::vector<slot_t> table(table_size, slot_t{VACANT, 0});
+
+        for (const entry_t& entry : entries) {
+            uint64_t pos = entry.hash % table_size;
+            while (table[pos].fingerprint != VACANT) {
+                ++pos;
+                if (pos == table_size) {
+                    pos = 0;
+                }
+            }
+            table[pos] = entry.slot;
+        }
+        m_table = std::move(table);
+    }
+
+    // Returns false if some entry cannot be placed within CUCKOO_MAX_KICKS evictions
+    bool place_cuckoo(const std::vector<entry_t>& entries, size_t num_buckets) {
+        cuckoo_bucket_t empty_bucket;
+        for (uint32_t k = 0; k < CUCKOO_SLOTS; ++k) {
+            empty_bucket.slots[k] = slot_t{VACANT, 0};
+        }
+        cache_aligned_vector<cuckoo_bucket_t> table(num_buckets, empty_bucket);
+
+        std::vector<uint64_t> slot_hashes(num_buckets * CUCKOO_SLOTS);
+        uint64_t rng = 0x2545f4914f6cdd1dULL;  // xorshift64 for choosing victims
+
+        for (const entry_t& entry : entries) {
+            uint64_t hash = entry.hash;
+            slot_t slot = entry.slot;
+
+            for (uint32_t kicks = 0;; ++kicks) {
+                const uint64_t b1 = cuckoo_first_bucket(hash, num_buckets);
+                const uint64_t b2 = cuckoo_second_bucket(hash, num_buckets);
+
+                bool placed = false;
+                for (uint64_t b : {b1, b2}) {
+                    cuckoo_bucket_t& bucket = table[b];
+                    for (uint32_t k = 0; k < CUCKOO_SLOTS && !placed; ++k) {
+                        if (bucket.slots[k].fingerprint == VACANT) {
+                            bucket.slots[k] = slot;
+                            slot_hashes[b * CUCKOO_SLOTS + k] = hash;
+                            placed = true;
+                        }
                     }
+                }
+                if (placed) {
                     break;
                 }
+                if (kicks == CUCKOO_MAX_KICKS) {
+                    return false;
+                }
+
+                // evict a random victim and move it to its other bucket in the next round
+                rng ^= rng << 13;
+                rng ^= rng >> 7;
+                rng ^= rng << 17;
+                const uint64_t b = (rng & 1) ? b1 : b2;
+                const uint32_t k = (rng >> 1) % CUCKOO_SLOTS;
+                cuckoo_bucket_t& bucket = table[b];
+                std::swap(hash, slot_hashes[b * CUCKOO_SLOTS + k]);
+                std::swap(slot, bucket.slots[k]);
+            }
+        }
+        m_cuckoo_table = std::move(table);
+        return true;
+    }
+
+    static uint64_t cuckoo_first_bucket(uint64_t hash, uint64_t num_buckets) {
+        return hash % num_buckets;
+    }
+    static uint64_t cuckoo_second_bucket(uint64_t hash, uint64_t num_buckets) {
+        hash = (hash ^ (hash >> 31)) * 0xbf58476d1ce4e5b9ULL;
+        return (hash ^ (hash >> 29)) % num_buckets;
+    }
+
+    // Checks if slot holds the variant of key whose j-th element is deleted
+    template <class Key, class Verify>
+    bool is_variant(const slot_t& slot, uint32_t fingerprint, Key key, uint32_t j, Verify&& verify) const {
+        if (slot.fingerprint != fingerprint) {
+            return false;
+        }
+        if (slot.ref & SINGLETON_FLAG) {
+            return verify(slot.ref & ~SINGLETON_FLAG, j);
+        }
+        if (m_store_signatures) {
+            return equal_signature(slot.ref, key, j);
+        }
+        const uint32_t first_id =
+            m_compress_postings ? posting_codec::first(&m_postings[m_offsets[slot.ref]]) : m_ids[m_offsets[slot.ref]];
+        return verify(first_id, j);
+    }
+
+    template <class Fn>
+    void report_list(const slot_t& slot, Fn&& fn) const {
+        if (slot.ref & SINGLETON_FLAG) {
+            fn(slot.ref & ~SINGLETON_FLAG);
+        } else if (m_compress_postings) {
+            posting_codec::decode(&m_postings[m_offsets[slot.ref]], fn);
+        } else {
+            for (uint32_t i = m_offsets[slot.ref]; i < m_offsets[slot.ref + 1]; ++i) {
+                fn(m_ids[i]);
+            }
+        }
+    }
+
+    // A probe of a variant hash is a position in m_table, or for the cuckoo table the index of a slot among the
+    // CUCKOO_SLOTS slots of the first bucket followed by those of the second one.
+    const slot_t& get_slot(uint64_t hash, uint64_t probe) const {
+        if (m_layout == table_layout::LINEAR_PROBING) {
+            return m_table[probe];
+        }
+        const uint64_t b = probe < CUCKOO_SLOTS ? cuckoo_first_bucket(hash, m_cuckoo_table.size())
+                                                : cuckoo_second_bucket(hash, m_cuckoo_table.size());
+        return m_cuckoo_table[b].slots[probe % CUCKOO_SLOTS];
+    }
+
+    void prefetch_home(uint64_t hash) const {
+        if (m_layout == table_layout::LINEAR_PROBING) {
+            __builtin_prefetch(&m_table[hash % m_table.size()]);
+        } else {
+            __builtin_prefetch(&m_cuckoo_table[cuckoo_first_bucket(hash, m_cuckoo_table.size())]);
+            __builtin_prefetch(&m_cuckoo_table[cuckoo_second_bucket(hash, m_cuckoo_table.size())]);
+        }
+    }
+
+    // Prefetches the signature and the list offset of the slot
+    void prefetch_refs(const slot_t& slot) const {
+        if (slot.ref & SINGLETON_FLAG) {
+            return;
+        }
+        if (m_store_signatures) {
+            m_signatures.prefetch(uint64_t(slot.ref) * m_length);
+        }
+        __builtin_prefetch(&m_offsets[slot.ref]);
+    }
+
+    // Returns the first probe of hash whose slot has the fingerprint, or NOT_FOUND
+    uint64_t find_fingerprint(uint64_t hash, uint32_t fingerprint) const {
+        if (m_layout == table_layout::LINEAR_PROBING) {
+            uint64_t pos = hash % m_table.size();
+            while (m_table[pos].fingerprint != VACANT) {
+                if (m_table[pos].fingerprint == fingerprint) {
+                    return pos;
+                }
+                ++pos;
+                if (pos == m_table.size()) {
+                    pos = 0;
+                }
+            }
+            return NOT_FOUND;
+        }
+        for (uint64_t probe = 0; probe < 2 * CUCKOO_SLOTS; ++probe) {
+            if (get_slot(hash, probe).fingerprint == fingerprint) {
+                return probe;
+            }
+        }
+        return NOT_FOUND;
+    }
 
+    // Returns the slot of the variant of key whose j-th element is deleted, searching from the given probe
+    template <class Key, class Verify>
+    const slot_t* find_variant(uint64_t hash, uint64_t probe, uint32_t fingerprint, Key key, uint32_t j,
+                               Verify&& verify) const {
+        if (m_layout == table_layout::LINEAR_PROBING) {
+            for (uint64_t pos = probe; m_table[pos].fingerprint != VACANT;) {
+                if (is_variant(m_table[pos], fingerprint, key, j, verify)) {
+                    return &m_table[pos];
+                }
                 ++pos;
                 if (pos == m_table.size()) {
                     pos = 0;
                 }
             }
+            return nullptr;
+        }
+        for (; probe < 2 * CUCKOO_SLOTS; ++probe) {
+            const slot_t& slot = get_slot(hash, probe);
+            if (is_variant(slot, fingerprint, key, j, verify)) {
+                return &slot;
+            }
         }
+        return nullptr;
     }
 
-    template <class T>
-    void make_signature(const T* key, uint32_t i, signature_t& out) const {
-        assert(out.size() == m_length);
-        std::copy(key, key + m_length, out.begin());
-        out[i] = m_del_marker;
+    // Upper bits of the variant hash followed by the deleted position, never equal to VACANT
+    uint32_t make_fingerprint(uint64_t hash, uint32_t pos) const {
+        uint32_t pos_bits = 1;
+        while ((1ULL << pos_bits) < m_length) {
+            ++pos_bits;
+        }
+        const uint32_t pos_mask = (1U << pos_bits) - 1;
+        uint32_t fingerprint = (uint32_t(hash >> 32) & ~pos_mask) | pos;
+        if (fingerprint == VACANT) {
+            fingerprint ^= pos_mask + 1;
+        }
+        return fingerprint;
+    }
+
+    // Checks if the rank-th signature is the variant of key whose i-th element is deleted
+    template <class Key>
+    bool equal_signature(uint64_t rank, Key key, uint32_t i) const {
+        const uint64_t sig_beg = rank * m_length;
+        if (is_binary()) {
+            for (uint32_t beg = 0; beg < m_length; beg += 64) {
+                const uint32_t length = std::min(m_length - beg, 64U);
+                uint64_t diff = m_signatures.get_bits(sig_beg + beg, length) ^ get_bits(key, beg, length);
+                if (i / 64 == beg / 64) {
+                    diff &= ~(1ULL << (i % 64));
+                }
+                if (diff != 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        if (m_signatures[sig_beg + i] != m_del_marker) {
+            return false;
+        }
+        for (uint32_t j = 0; j < m_length; ++j) {
+            if (j != i && m_signatures[sig_beg + j] != key[j]) {
+                return false;
+            }
+        }
+        return true;
     }
 };
 
+// Results of hm_index::search_batch in CSR form: the ids found for the i-th query are
+// ids[offsets[i]..offsets[i + 1]). The buffers keep their capacity when reused for another batch.
+struct search_results {
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> ids;
+};
+
 class hm_index {
   public:
     using size_type = uint64_t;  // for sdsl::serialize
 
   private:
+    static constexpr uint32_t FORMAT_VERSION = 2;
+    static constexpr uint32_t INTERLEAVED_QUERIES = 8;  // queries in flight in a batch search
+    static constexpr uint32_t MAX_AUTO_VERTICAL_LEVELS = 6;
+
     std::vector<odv_index> m_odv_indexes;
     std::vector<uint32_t> m_bucket_begs;
     uint32_t m_length = 0;
     uint32_t m_alphabet_size = 0;
     uint32_t m_buckets = 0;
-#ifdef HMSEARCH_DISABLE_VERT
-    sdsl::int_vector<> m_keys;
-#else
-    sdsl::int_vector<> m_vertical_keys;
+    // Only the key codes of the chosen layout are stored.
+    bool m_vertical = false;
+    packed_array m_keys;
+    pod_array<uint64_t, aligned_allocator<uint64_t, 64>> m_vertical_keys;  // one word per code
     uint32_t m_vertical_levels = 0;
-#endif
+    uint32_t m_vertical_words = 0;  // 64-bit words per level of a code
+
+    // Keys inserted after build() form the delta segment: ids from m_num_base_keys on are resolved by
+    // per-bucket tables from variant hashes to ids, verified against the growable delta key codes.
+    uint32_t m_num_base_keys = 0;
+    std::vector<std::unordered_map<uint64_t, std::vector<uint32_t>>> m_delta_tables;
+    std::vector<uint32_t> m_delta_keys;
+    std::vector<uint64_t> m_delta_vertical_keys;
+
+    // Ids handed out to users stay stable while merges drop erased keys: m_ext_ids maps the position of each
+    // stored key to its id in ascending order, and is empty while the two coincide.
+    std::vector<uint32_t> m_ext_ids;
+    uint32_t m_next_id = 0;
+    std::vector<uint64_t> m_tombstones;  // bitmap over stored positions, grown on demand
+    uint32_t m_num_erased = 0;
+
+    std::future<std::unique_ptr<hm_index>> m_merge;
+    uint32_t m_num_merging_keys = 0;
+
+    // Hit counts of a stored key. Each group of fields is valid only while its epoch is the current one, so the
+    // counters are reset lazily instead of being cleared for every query and bucket.
+    struct counter_t {
+        uint32_t query_epoch;
+        uint32_t bucket_epoch;
+        uint16_t num_matches;    // variants matched in the current bucket
+        uint16_t num_exact;      // buckets matched exactly
+        uint16_t num_one_error;  // buckets matched with one error
+    };
+
+    // State of a query in flight in search_interleaved, for the index-th query of the batch
+    struct query_state {
+        enum stage_t { PREFETCH, LOCATE, PROBE, FILTER, VERIFY, IDLE };
+
+        stage_t stage = IDLE;
+        size_t index = 0;
+        uint32_t bucket = 0;
+        odv_index::search_scratch odv;
+        std::vector<uint64_t> vertical_query;
+        std::vector<uint32_t> hits;      // ids matched in the buckets probed so far
+        std::vector<uint64_t> hit_ends;  // the hits of the b-th bucket end at hits[hit_ends[b]]
+        std::vector<uint32_t> cand_ids;
+    };
+
+    // Working memory of search, reused across queries. The counters are dense over stored positions, and the
+    // positions touched by the current query and bucket are listed so that only those are visited.
+    // A sparse scratch, meant for a single search, has no dense counters: the hits of a bucket are sorted and
+    // counted by runs, and the scores of the query are kept as (id, score) pairs sorted by id. A search then
+    // costs O(h log h) time and space for h hits instead of O(size()) for setting up the counters.
+    struct search_scratch {
+        odv_index::search_scratch odv;
+        bool sparse = false;
+        std::vector<counter_t> counters;
+        uint32_t epoch = 0;
+        uint32_t query_epoch = 0;
+        std::vector<std::pair<uint32_t, uint32_t>> scores;  // of a sparse scratch
+        std::vector<std::pair<uint32_t, uint32_t>> merged_scores;
+        std::vector<uint32_t> bucket_ids;
+        std::vector<uint32_t> touched_ids;
+        std::vector<uint32_t> cand_ids;
+        std::vector<uint64_t> vertical_query;
+        std::vector<uint32_t> found_ids;  // ids verified by a thread of search_parallel
+
+        // Buffers of batch searches
+        std::vector<std::pair<uint64_t, size_t>> query_hashes;
+        std::vector<size_t> firsts;
+        std::vector<uint32_t> batch_ids;
+        std::vector<uint64_t> begs;
+        std::vector<uint64_t> ends;
+        std::vector<uint32_t> owners;  // thread whose batch_ids hold the ids of a query
+        std::vector<query_state> states;
+
+        void begin_query(uint32_t num_keys) {
+            if (sparse) {
+                scores.clear();
+                return;
+            }
+            if (counters.size() < num_keys) {
+                counters.resize(num_keys, counter_t{0, 0, 0, 0, 0});
+            }
+            query_epoch = next_epoch();
+            touched_ids.clear();
+        }
+        void begin_bucket() {
+            if (!sparse) {
+                next_epoch();
+            }
+            bucket_ids.clear();
+        }
+        void count(uint32_t id) {
+            if (sparse) {
+                bucket_ids.push_back(id);
+                return;
+            }
+            counter_t& c = counters[id];
+            if (c.bucket_epoch != epoch) {
+                c.bucket_epoch = epoch;
+                c.num_matches = 0;
+                bucket_ids.push_back(id);
+            }
+            ++c.num_matches;
+        }
+        // A key with one error in the bucket matches only one variant, while an exact one matches all the
+        // variants; in a bucket of length 1 the two cannot be told apart, so the key is counted as exact.
+        void end_bucket(bool single) {
+            if (sparse) {
+                merge_bucket_scores(single);
+                return;
+            }
+            for (uint32_t id : bucket_ids) {
+                counter_t& c = counters[id];
+                if (c.query_epoch != query_epoch) {
+                    c.query_epoch = query_epoch;
+                    c.num_exact = c.num_one_error = 0;
+                    touched_ids.push_back(id);
+                }
+                if (single || c.num_matches > 1) {
+                    ++c.num_exact;
+                } else {
+                    ++c.num_one_error;
+                }
+            }
+        }
+        uint32_t get_score(uint32_t id) const {
+            return 2 * counters[id].num_exact + counters[id].num_one_error;
+        }
+        // Calls fn(id, score) for every key counted by the current query
+        template <class Fn>
+        void for_each_score(Fn&& fn) const {
+            if (sparse) {
+                for (const auto& id_score : scores) {
+                    fn(id_score.first, id_score.second);
+                }
+                return;
+            }
+            for (uint32_t id : touched_ids) {
+                fn(id, get_score(id));
+            }
+        }
+        // Adds the bucket counts of the current query in other, which counted other buckets of the same query
+        void merge_counts(const search_scratch& other) {
+            assert(!sparse && !other.sparse);
+            for (uint32_t id : other.touched_ids) {
+                counter_t& c = counters[id];
+                if (c.query_epoch != query_epoch) {
+                    c.query_epoch = query_epoch;
+                    c.num_exact = c.num_one_error = 0;
+                    touched_ids.push_back(id);
+                }
+                c.num_exact += other.counters[id].num_exact;
+                c.num_one_error += other.counters[id].num_one_error;
+            }
+        }
+
+      private:
+        // Adds the scores of the bucket hits, a run of the same id scoring as an exact bucket, to the sorted scores
+        void merge_bucket_scores(bool single) {
+            std::sort(bucket_ids.begin(), bucket_ids.end());
+            merged_scores.clear();
+            auto it = scores.begin();
+            for (size_t i = 0, k = 0; i < bucket_ids.size(); i = k) {
+                const uint32_t id = bucket_ids[i];
+                while (k < bucket_ids.size() && bucket_ids[k] == id) {
+                    ++k;
+                }
+                for (; it != scores.end() && it->first < id; ++it) {
+                    merged_scores.push_back(*it);
+                }
+                uint32_t score = single || k - i > 1 ? 2 : 1;
+                if (it != scores.end() && it->first == id) {
+                    score += it->second;
+                    ++it;
+                }
+                merged_scores.emplace_back(id, score);
+            }
+            merged_scores.insert(merged_scores.end(), it, scores.end());
+            scores.swap(merged_scores);
+        }
+
+        // On wraparound the stale stamps are cleared so that they cannot collide with the restarted epochs, and
+        // those of the current query move to epoch 1.
+        uint32_t next_epoch() {
+            if (++epoch == 0) {
+                for (counter_t& c : counters) {
+                    c.query_epoch = c.query_epoch == query_epoch ? 1 : 0;
+                    c.bucket_epoch = 0;
+                }
+                query_epoch = 1;
+                epoch = 2;
+            }
+            return epoch;
+        }
+    };
+
+    // Range of the batch left to a thread of search_batch_parallel, packed as (beg << 32 | end)
+    struct alignas(64) batch_worker {
+        std::atomic<uint64_t> range;
+        uint64_t num_candidates = 0;
+    };
+    using batch_workers = cache_aligned_vector<batch_worker>;
 
   public:
     hm_index() = default;
     ~hm_index() = default;
 
+    hm_index(hm_index&&) = default;
+    hm_index& operator=(hm_index&&) = default;
+
     size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const {
         auto child = sdsl::structure_tree::add_child(v, name, sdsl::util::class_name(*this));
-        size_type written_bytes = 0;
-        written_bytes += sdsl::serialize(m_odv_indexes, out);
-        written_bytes += sdsl::serialize(m_bucket_begs, out);
-        written_bytes += sdsl::serialize(m_length, out);
-        written_bytes += sdsl::serialize(m_alphabet_size, out);
-        written_bytes += sdsl::serialize(m_buckets, out);
-#ifdef HMSEARCH_DISABLE_VERT
-        written_bytes += sdsl::serialize(m_keys, out);
-#else
-        written_bytes += sdsl::serialize(m_vertical_keys, out);
-        written_bytes += sdsl::serialize(m_vertical_levels, out);
-#endif
-        sdsl::structure_tree::add_size(child, written_bytes);
-        return written_bytes;
+        index_writer writer(out);
+        write(writer);
+        sdsl::structure_tree::add_size(child, writer.written_bytes());
+        return writer.written_bytes();
     }
 
     void load(std::istream& in) {
-        sdsl::load(m_odv_indexes, in);
-        sdsl::load(m_bucket_begs, in);
-        sdsl::load(m_length, in);
-        sdsl::load(m_alphabet_size, in);
-        sdsl::load(m_buckets, in);
-#ifdef HMSEARCH_DISABLE_VERT
-        sdsl::load(m_keys, in);
-#else
-        sdsl::load(m_vertical_keys, in);
-        sdsl::load(m_vertical_levels, in);
-#endif
+        index_reader reader(in);
+        read(reader);
+    }
+
+    // Maps an index file written by serialize() and uses its tables and key codes in place, without reading
+    // them. The file must not be modified while the index (or an index merged from it) is in use.
+    void map(const std::string& fn) {
+        index_reader reader(std::make_shared<const mapped_file>(fn));
+        read(reader);
+    }
+
+    void write(index_writer& out) const {
+        out.write(uint32_t(FORMAT_VERSION));
+        out.write(m_length);
+        out.write(m_alphabet_size);
+        out.write(m_buckets);
+        out.write_vector(m_bucket_begs);
+        for (const odv_index& odv_idx : m_odv_indexes) {
+            odv_idx.write(out);
+        }
+        out.write(uint32_t(m_vertical));
+        out.write(m_vertical_levels);
+        m_keys.write(out);
+        m_vertical_keys.write(out);
+        out.write(m_num_base_keys);
+        out.write_vector(m_delta_keys);
+        out.write_vector(m_delta_vertical_keys);
+        out.write_vector(m_ext_ids);
+        out.write(m_next_id);
+        out.write_vector(m_tombstones);
+        out.write(m_num_erased);
+    }
+
+    void read(index_reader& in) {
+        uint32_t version = 0;
+        in.read(version);
+        HMSEARCH_CHECK_IF(version != FORMAT_VERSION, "unsupported format of hm_index.");
+        in.read(m_length);
+        in.read(m_alphabet_size);
+        in.read(m_buckets);
+        in.read_vector(m_bucket_begs);
+        m_odv_indexes = std::vector<odv_index>(m_buckets);
+        for (odv_index& odv_idx : m_odv_indexes) {
+            odv_idx.read(in);
+        }
+        uint32_t vertical = 0;
+        in.read(vertical);
+        m_vertical = vertical != 0;
+        in.read(m_vertical_levels);
+        m_vertical_words = (m_length + 63) / 64;
+        m_keys.read(in);
+        m_vertical_keys.read(in);
+        in.read(m_num_base_keys);
+
+        // The delta tables are not stored but rebuilt from the delta keys.
+        in.read_vector(m_delta_keys);
+        in.read_vector(m_delta_vertical_keys);
+        reinsert_delta(m_num_base_keys);
+
+        in.read_vector(m_ext_ids);
+        in.read(m_next_id);
+        in.read_vector(m_tombstones);
+        in.read(m_num_erased);
     }
 
     uint32_t get_length() const {
@@ -303,29 +1755,75 @@ class hm_index {
     uint32_t get_buckets() const {
         return m_buckets;
     }
-#ifndef HMSEARCH_DISABLE_VERT
+    // Number of stored keys, including inserted ones and erased ones not dropped by a merge yet
+    uint32_t size() const {
+        return m_num_base_keys + get_num_delta_keys();
+    }
+    uint32_t get_num_delta_keys() const {
+        if (m_vertical) {
+            return m_delta_vertical_keys.size() / get_vertical_codes_per_key();
+        }
+        return m_length == 0 ? 0 : m_delta_keys.size() / m_length;
+    }
+    uint32_t get_num_erased() const {
+        return m_num_erased;
+    }
+    key_layout get_key_layout() const {
+        return m_vertical ? key_layout::VERTICAL : key_layout::HORIZONTAL;
+    }
     uint32_t get_vertical_levels() const {
         return m_vertical_levels;
     }
-#endif
+
+    // Layout chosen for key_layout::AUTO. Vertical codes take one word per bit of the symbols and 64 symbols, so
+    // they pay off only while the symbols are a few bits wide; wider ones are compared faster one by one, since a
+    // candidate usually fails after a few symbols.
+    static key_layout choose_key_layout(uint32_t alphabet_size, uint32_t length) {
+        return get_symbol_bits(alphabet_size) <= MAX_AUTO_VERTICAL_LEVELS && length >= 16 ? key_layout::VERTICAL
+                                                                                          : key_layout::HORIZONTAL;
+    }
+
+    // Bits of a stored symbol, i.e., levels of a vertical code. The deletion marker is never stored, so binary
+    // keys take one level and their vertical codes are the keys packed into words.
+    static uint32_t get_symbol_bits(uint32_t alphabet_size) {
+        return alphabet_size <= 2 ? 1 : sdsl::bits::hi(alphabet_size - 1) + 1;
+    }
 
     static uint32_t get_proper_buckets(uint32_t range) {
         return (range + 3) / 2;
     }
+    // Largest range searchable with the given number of buckets: a key within it has at most one error in
+    // some bucket, since otherwise it has at least 2 * buckets errors.
+    static uint32_t get_max_range(uint32_t buckets) {
+        return 2 * buckets - 1;
+    }
+    uint32_t get_max_range() const {
+        return get_max_range(m_buckets);
+    }
 
+    // With num_threads > 1, independent buckets are built concurrently and the remaining threads are shared
+    // among the bucket builds; vertical codes are then filled in parallel chunks.
     template <class T>
-    void build(const std::vector<const T*>& keys, uint32_t length, uint32_t alphabet_size, uint32_t buckets) {
-        HMSEARCH_CHECK_IF(length > 64, "length > 64 is not supported.");
-
+    void build(const std::vector<const T*>& keys, uint32_t length, uint32_t alphabet_size, uint32_t buckets,
+               uint32_t num_threads = 1, const build_config& config = build_config()) {
 #ifdef HMSEARCH_PRINT_PROGRESS
-        std::cerr << " # [hm_index::build] buckets = " << buckets << std::endl;
+        std::cerr << " # [hm_index::build] buckets = " << buckets << ", threads = " << num_threads << std::endl;
 #endif
 
         m_length = length;
         m_alphabet_size = alphabet_size;
         m_buckets = buckets;
+        m_num_base_keys = keys.size();
+        m_next_id = keys.size();
+        m_ext_ids.clear();
+        m_tombstones.clear();
+        m_num_erased = 0;
 
-        m_odv_indexes.resize(m_buckets);
+        m_delta_tables = std::vector<std::unordered_map<uint64_t, std::vector<uint32_t>>>(m_buckets);
+        m_delta_keys.clear();
+        m_delta_vertical_keys.clear();
+
+        m_odv_indexes = std::vector<odv_index>(m_buckets);
         m_bucket_begs.resize(m_buckets + 1);
 
         uint32_t bucket_beg = 0;
@@ -335,146 +1833,1211 @@ class hm_index {
         }
         m_bucket_begs[m_buckets] = bucket_beg;
 
-        std::vector<const T*> bucket_keys(keys.size());
-        for (uint32_t b = 0; b < m_buckets; ++b) {
+        num_threads = std::max<uint32_t>(num_threads, 1);
+        const uint32_t num_workers = std::min(num_threads, m_buckets);
+        const uint32_t threads_per_worker = num_threads / num_workers;
+
+        std::atomic<uint32_t> next_bucket(0);
+        parallel_for(num_workers, num_workers, [&](size_t, size_t) {
+            std::vector<const T*> bucket_keys(keys.size());
+            for (uint32_t b = next_bucket++; b < m_buckets; b = next_bucket++) {
 #ifdef HMSEARCH_PRINT_PROGRESS
-            std::cerr << " #   - bucket_id = " << b << std::endl;
+                if (num_workers == 1) {
+                    std::cerr << " #   - bucket_id = " << b << std::endl;
+                }
 #endif
-            for (size_t i = 0; i < keys.size(); ++i) {
-                bucket_keys[i] = keys[i] + m_bucket_begs[b];
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    bucket_keys[i] = keys[i] + m_bucket_begs[b];
+                }
+                m_odv_indexes[b].build(bucket_keys, m_bucket_begs[b + 1] - m_bucket_begs[b], alphabet_size,
+                                       threads_per_worker, num_workers == 1, config);
             }
-            m_odv_indexes[b].build(bucket_keys, m_bucket_begs[b + 1] - m_bucket_begs[b], alphabet_size);
+        });
+
+        // Chunks consist of multiples of 64 keys so that no two threads write to the same packed word.
+        const size_t num_blocks = (keys.size() + 63) / 64;
+
+        const key_layout layout =
+            config.keys == key_layout::AUTO ? choose_key_layout(alphabet_size, length) : config.keys;
+        m_vertical = layout == key_layout::VERTICAL;
+        m_vertical_levels = get_symbol_bits(alphabet_size);
+        m_vertical_words = (m_length + 63) / 64;
+
+        if (m_vertical) {
+            const uint32_t codes_per_key = get_vertical_codes_per_key();
+            cache_aligned_vector<uint64_t> vertical_keys(keys.size() * codes_per_key);
+            parallel_for(num_blocks, num_threads, [&](size_t block_beg, size_t block_end) {
+                for (size_t i = block_beg * 64; i < std::min(block_end * 64, keys.size()); ++i) {
+                    make_vertical_codes(keys[i], &vertical_keys[i * codes_per_key]);
+                }
+            });
+            m_vertical_keys = std::move(vertical_keys);
+            m_keys = packed_array();
+        } else {
+            m_keys = packed_array(keys.size() * m_length, m_vertical_levels);
+            parallel_for(num_blocks, num_threads, [&](size_t block_beg, size_t block_end) {
+                for (size_t i = block_beg * 64; i < std::min(block_end * 64, keys.size()); ++i) {
+                    for (uint32_t j = 0; j < m_length; ++j) {
+                        m_keys.set(i * m_length + j, keys[i][j]);
+                    }
+                }
+            });
+            m_vertical_keys = pod_array<uint64_t, aligned_allocator<uint64_t, 64>>();
+        }
+    }
+
+    // Appends key to the delta segment and returns its id, which follows the ids of all the previous keys.
+    // The key is searchable as soon as this returns.
+    template <class T>
+    uint32_t insert(const T* key) {
+        HMSEARCH_CHECK_IF(m_buckets == 0, "index is not built.");
+        for (uint32_t j = 0; j < m_length; ++j) {
+            HMSEARCH_CHECK_IF(uint32_t(key[j]) >= m_alphabet_size, "keys include a large character.");
         }
 
-#ifdef HMSEARCH_DISABLE_VERT
-        m_keys = sdsl::int_vector<>(keys.size() * m_length, 0, sdsl::bits::hi(alphabet_size) + 1);
-        for (size_t i = 0; i < keys.size(); ++i) {
-            std::copy(keys[i], keys[i] + m_length, m_keys.begin() + (i * m_length));
+        const uint32_t id = m_next_id++;
+        if (!m_ext_ids.empty()) {
+            m_ext_ids.push_back(id);
+        }
+        insert_delta_variants(key, size());
+        if (m_vertical) {
+            m_delta_vertical_keys.resize(m_delta_vertical_keys.size() + get_vertical_codes_per_key());
+            make_vertical_codes(key,
+                                &m_delta_vertical_keys[m_delta_vertical_keys.size() - get_vertical_codes_per_key()]);
+        } else {
+            std::copy(key, key + m_length, std::back_inserter(m_delta_keys));
+        }
+        return id;
+    }
+
+    // Marks the key of the given id as erased so that search skips it before verification. Returns false if
+    // no such key is stored or it is already erased. The key is dropped from the index by the next merge.
+    bool erase(uint32_t id) {
+        uint32_t pos = 0;
+        if (!find_position(m_ext_ids, size(), id, pos) || is_erased(pos)) {
+            return false;
+        }
+        if (m_tombstones.size() <= pos / 64) {
+            m_tombstones.resize(pos / 64 + 1, 0);
+        }
+        m_tombstones[pos / 64] |= 1ULL << (pos % 64);
+        ++m_num_erased;
+        return true;
+    }
+
+    // Starts a merge, which drops the erased keys, if they make up at least min_erased_ratio of the stored keys
+    // and no merge is running. Searches go on against the current version until finish_merge().
+    bool start_compaction(uint32_t num_threads = 1, double min_erased_ratio = 0.1) {
+        if (m_merge.valid() || m_num_erased == 0 || m_num_erased < min_erased_ratio * size()) {
+            return false;
         }
-#else
-        m_vertical_levels = sdsl::bits::hi(alphabet_size) + 1;
-        m_vertical_keys = sdsl::int_vector<>(keys.size() * m_vertical_levels, 0, m_length);
-        for (size_t i = 0; i < keys.size(); ++i) {
-            const size_t beg = i * m_vertical_levels;
-            for (uint32_t j = 0; j < m_vertical_levels; ++j) {
-                m_vertical_keys[beg + j] = make_vertical_code(keys[i], m_length, j);
+        start_merge(num_threads);
+        return true;
+    }
+
+    // Starts folding all the keys inserted so far into a new base index built on a background thread, dropping
+    // the erased keys.
+    // Searches and inserts may go on meanwhile, but the index must not be moved, rebuilt or loaded until
+    // finish_merge() has installed the new base.
+    void start_merge(uint32_t num_threads = 1) {
+        HMSEARCH_CHECK_IF(m_merge.valid(), "merge is already running.");
+        if (m_alphabet_size <= 256) {
+            launch_merge<uint8_t>(num_threads);
+        } else {
+            launch_merge<uint32_t>(num_threads);
+        }
+    }
+
+    // Replaces the base with the merged one and keeps the keys inserted during the merge in the delta segment,
+    // as well as the erasures made during the merge.
+    // Returns false if no merge was started, or if wait is false and the merge has not finished yet.
+    bool finish_merge(bool wait = true) {
+        if (!m_merge.valid()) {
+            return false;
+        }
+        if (!wait && m_merge.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+
+        std::unique_ptr<hm_index> merged = m_merge.get();
+        const uint32_t num_merged = m_num_merging_keys;
+        const uint32_t num_kept = merged->m_num_base_keys;
+
+        std::vector<uint32_t> ext_ids = std::move(merged->m_ext_ids);
+        if (!ext_ids.empty()) {
+            for (uint32_t pos = num_merged; pos < size(); ++pos) {
+                ext_ids.push_back(get_external_id(pos));
             }
         }
-#endif
+        const uint32_t num_keys = num_kept + (size() - num_merged);
+
+        // Erasures made during the merge refer to keys the merge has kept.
+        std::vector<uint64_t> tombstones;
+        uint32_t num_erased = 0;
+        for (uint32_t w = 0; w < m_tombstones.size(); ++w) {
+            for (uint64_t bits = m_tombstones[w]; bits != 0; bits &= bits - 1) {
+                uint32_t pos = 0;
+                if (find_position(ext_ids, num_keys, get_external_id(w * 64 + sdsl::bits::lo(bits)), pos)) {
+                    if (tombstones.size() <= pos / 64) {
+                        tombstones.resize(pos / 64 + 1, 0);
+                    }
+                    tombstones[pos / 64] |= 1ULL << (pos % 64);
+                    ++num_erased;
+                }
+            }
+        }
+
+        const uint64_t num_dropped = num_merged - m_num_base_keys;
+        if (m_vertical) {
+            m_delta_vertical_keys.erase(m_delta_vertical_keys.begin(),
+                                        m_delta_vertical_keys.begin() + num_dropped * get_vertical_codes_per_key());
+        } else {
+            m_delta_keys.erase(m_delta_keys.begin(), m_delta_keys.begin() + num_dropped * m_length);
+        }
+        m_keys = std::move(merged->m_keys);
+        m_vertical_keys = std::move(merged->m_vertical_keys);
+        m_odv_indexes = std::move(merged->m_odv_indexes);
+        m_ext_ids = std::move(ext_ids);
+        m_tombstones = std::move(tombstones);
+        m_num_erased = num_erased;
+        reinsert_delta(num_kept);
+        return true;
+    }
+
+    // Equivalent to start_merge() followed by finish_merge().
+    void merge(uint32_t num_threads = 1) {
+        start_merge(num_threads);
+        finish_merge();
+    }
+
+    // Restores the symbols of the key of the given id from the key codes, unless no such key is stored.
+    template <class T>
+    bool extract_key(uint32_t id, T* out) const {
+        uint32_t pos = 0;
+        if (!find_position(m_ext_ids, size(), id, pos)) {
+            return false;
+        }
+        restore_key(pos, out);
+        return true;
+    }
+
+    // fn(id) is called for every id within the range; any callable works, and functors inline into the search.
+    // The hits are counted sparsely, so that a search takes time in the number of hits rather than of keys;
+    // hm_searcher keeps dense counters across searches and is the way to search many queries.
+    template <class T, class Fn>
+    uint64_t search(const T* query, uint32_t hamming_range, Fn&& fn) const {
+        search_scratch scratch;
+        scratch.sparse = true;
+        return search(query, hamming_range, scratch, fn);
+    }
+
+    // Searches a query of a binary index given as (length + 63) / 64 words whose j-th bit is the j-th symbol.
+    // search() packs a binary query into such words anyway, which this saves. The hits are counted sparsely as
+    // in search.
+    template <class Fn>
+    uint64_t search_packed(const uint64_t* query, uint32_t hamming_range, Fn&& fn) const {
+        search_scratch scratch;
+        scratch.sparse = true;
+        return search_packed(query, hamming_range, scratch, fn);
+    }
+
+    // Searches queries[0..num_queries) and stores the ids of the i-th query in
+    // results.ids[results.offsets[i]..results.offsets[i + 1]), reusing the buffers of results and the working
+    // memory of search throughout the batch. Repeated queries are searched once. Returns the number of verified
+    // candidates. With num_threads > 1 the queries are searched in parallel with work stealing.
+    // The threads and the working memory are set up for every call; an hm_searcher keeps them across batches.
+    template <class T>
+    uint64_t search_batch(const T* const* queries, size_t num_queries, uint32_t hamming_range,
+                          search_results& results, uint32_t num_threads = 1) const {
+        thread_pool pool(num_threads);
+        std::vector<search_scratch> scratches(pool.size());
+        batch_workers workers(pool.size());
+        return search_batch(queries, num_queries, hamming_range, pool, scratches, workers, results);
+    }
+
+    // Searches a batch like search_batch, but as a hash join against every bucket: the variants of all the
+    // distinct queries are listed and sorted by their home slots, each distinct variant is looked up once in table
+    // order, and its list is fanned out to the queries sharing it. This pays off for large batches whose queries
+    // share variants. The variants are sorted and the candidates verified on num_threads threads.
+    template <class T>
+    uint64_t search_batch_join(const T* const* queries, size_t num_queries, uint32_t hamming_range,
+                               search_results& results, uint32_t num_threads = 1) const {
+        thread_pool pool(num_threads);
+        std::vector<search_scratch> scratches(pool.size());
+        return search_batch_join(queries, num_queries, hamming_range, pool, scratches, results);
     }
 
+  private:
+    friend class hm_searcher;
+
+    // Checks if the two keys of length are equal except for the pos-th element
     template <class T>
-    uint64_t search(const T* query, uint32_t hamming_range, std::function<void(uint32_t)> fn) const {
-        HMSEARCH_CHECK_IF(m_buckets != get_proper_buckets(hamming_range), "unsupported hamming range.");
+    static bool equal_variant(const T* x, const T* y, uint32_t length, uint32_t pos) {
+        for (uint32_t j = 0; j < length; ++j) {
+            if (j != pos && x[j] != y[j]) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-        signature_t sig;
-        std::unordered_map<uint32_t, uint32_t> match_map;
-        std::unordered_map<uint32_t, std::vector<uint32_t>> cand_map;
+    template <class T>
+    uint64_t search_batch(const T* const* queries, size_t num_queries, uint32_t hamming_range,
+                          search_scratch& scratch, search_results& results) const {
+        std::vector<size_t>& firsts = scratch.firsts;
+        find_first_equals(queries, num_queries, scratch.query_hashes, firsts);
+
+        std::vector<uint32_t>& ids = scratch.batch_ids;
+        std::vector<uint64_t>& begs = scratch.begs;
+        std::vector<uint64_t>& ends = scratch.ends;
+        ids.clear();
+        begs.resize(num_queries);
+        ends.resize(num_queries);
+
+        size_t next_i = 0;
+        auto next = [&](size_t& i) {
+            while (next_i < num_queries && firsts[next_i] != next_i) {
+                ++next_i;
+            }
+            if (next_i == num_queries) {
+                return false;
+            }
+            i = next_i++;
+            return true;
+        };
+        auto done = [&](size_t i, uint64_t beg, uint64_t end) {
+            begs[i] = beg;
+            ends[i] = end;
+        };
+        const uint64_t num_candidates = search_interleaved(queries, hamming_range, scratch, ids, next, done);
+
+        gather_results(firsts, begs, ends, [&](size_t) -> const std::vector<uint32_t>& { return ids; }, results);
+        return num_candidates;
+    }
+
+    // Searches the batch on the threads of pool, with working memory scratches[t] and workers[t] for the t-th
+    // thread
+    template <class T>
+    uint64_t search_batch(const T* const* queries, size_t num_queries, uint32_t hamming_range, thread_pool& pool,
+                          std::vector<search_scratch>& scratches, batch_workers& workers,
+                          search_results& results) const {
+        if (pool.size() > 1 && num_queries > 1) {
+            return search_batch_parallel(queries, num_queries, hamming_range, pool, scratches, workers, results);
+        }
+        return search_batch(queries, num_queries, hamming_range, scratches[0], results);
+    }
+
+    // Each worker pops queries from the front of its own range of the batch and, once the range is exhausted,
+    // steals the back half of the range of another worker, so that a few expensive queries do not leave the
+    // other threads idle. A range [beg, end) is packed into one atomic word as (beg << 32 | end).
+    // The t-th thread of pool works in scratches[t] and workers[t].
+    template <class T>
+    uint64_t search_batch_parallel(const T* const* queries, size_t num_queries, uint32_t hamming_range,
+                                   thread_pool& pool, std::vector<search_scratch>& scratches, batch_workers& workers,
+                                   search_results& results) const {
+        HMSEARCH_CHECK_IF(num_queries > UINT32_MAX, "too many queries for a parallel batch.");
+
+        std::vector<size_t>& firsts = scratches[0].firsts;
+        find_first_equals(queries, num_queries, scratches[0].query_hashes, firsts);
+
+        auto pack = [](uint64_t beg, uint64_t end) { return (beg << 32) | end; };
+
+        const uint32_t num_threads = std::min<size_t>(pool.size(), num_queries);
+        assert(workers.size() >= num_threads);
+        for (uint32_t t = 0; t < num_threads; ++t) {
+            workers[t].range = pack(num_queries * t / num_threads, num_queries * (t + 1) / num_threads);
+            workers[t].num_candidates = 0;
+        }
+        std::atomic<uint64_t> num_unclaimed(num_queries);
+
+        auto pop_front = [&](batch_worker& w, uint32_t& i) {
+            uint64_t r = w.range.load();
+            while ((r >> 32) < (r & UINT32_MAX)) {
+                if (w.range.compare_exchange_weak(r, r + (1ULL << 32))) {
+                    i = r >> 32;
+                    --num_unclaimed;
+                    return true;
+                }
+            }
+            return false;
+        };
+        // The thief's own range is empty, so no other thread writes it meanwhile.
+        auto steal_back = [&](batch_worker& victim, batch_worker& thief) {
+            uint64_t r = victim.range.load();
+            while ((r >> 32) < (r & UINT32_MAX)) {
+                const uint64_t beg = r >> 32, end = r & UINT32_MAX;
+                const uint64_t mid = end - (end - beg + 1) / 2;
+                if (victim.range.compare_exchange_weak(r, pack(beg, mid))) {
+                    thief.range = pack(mid, end);
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        std::vector<uint32_t>& owners = scratches[0].owners;
+        std::vector<uint64_t>& local_begs = scratches[0].begs;
+        std::vector<uint64_t>& local_ends = scratches[0].ends;
+        owners.resize(num_queries);
+        local_begs.resize(num_queries);
+        local_ends.resize(num_queries);
+
+        pool.run([&](uint32_t t) {
+            if (t >= num_threads) {
+                return;
+            }
+            search_scratch& scratch = scratches[t];
+            batch_worker& w = workers[t];
+            auto next = [&](size_t& i) {
+                uint32_t q = 0;
+                while (num_unclaimed > 0) {
+                    if (!pop_front(w, q)) {
+                        bool stolen = false;
+                        for (uint32_t k = 1; k < num_threads && !stolen; ++k) {
+                            stolen = steal_back(workers[(t + k) % num_threads], w);
+                        }
+                        if (!stolen) {
+                            std::this_thread::yield();
+                        }
+                    } else if (firsts[q] == q) {
+                        i = q;
+                        return true;
+                    }
+                }
+                return false;
+            };
+            auto done = [&](size_t i, uint64_t beg, uint64_t end) {
+                owners[i] = t;
+                local_begs[i] = beg;
+                local_ends[i] = end;
+            };
+            scratch.batch_ids.clear();
+            w.num_candidates = search_interleaved(queries, hamming_range, scratch, scratch.batch_ids, next, done);
+        });
+
+        gather_results(firsts, local_begs, local_ends,
+                       [&](size_t i) -> const std::vector<uint32_t>& { return scratches[owners[i]].batch_ids; },
+                       results);
+
+        uint64_t num_candidates = 0;
+        for (uint32_t t = 0; t < num_threads; ++t) {
+            num_candidates += workers[t].num_candidates;
+        }
+        return num_candidates;
+    }
+
+    // Joins the batch on the threads of pool, with working memory scratches[t] for the t-th thread
+    template <class T>
+    uint64_t search_batch_join(const T* const* queries, size_t num_queries, uint32_t hamming_range,
+                               thread_pool& pool, std::vector<search_scratch>& scratches,
+                               search_results& results) const {
+        HMSEARCH_CHECK_IF(hamming_range > get_max_range(), "unsupported hamming range.");
+        HMSEARCH_CHECK_IF(num_queries > UINT32_MAX, "too many queries for a joined batch.");
+
+        std::vector<size_t>& firsts = scratches[0].firsts;
+        find_first_equals(queries, num_queries, scratches[0].query_hashes, firsts);
+
+        std::vector<size_t> distinct;  // indexes of the distinct queries
+        for (size_t i = 0; i < num_queries; ++i) {
+            if (firsts[i] == i) {
+                distinct.push_back(i);
+            }
+        }
+
+        const uint32_t codes_per_key = m_vertical ? get_vertical_codes_per_key() : 0;
+        std::vector<uint64_t> vertical_queries(distinct.size() * codes_per_key);
+        for (size_t q = 0; m_vertical && q < distinct.size(); ++q) {
+            make_vertical_codes(queries[distinct[q]], &vertical_queries[q * codes_per_key]);
+        }
+        auto vertical_query_of = [&](size_t q) { return vertical_queries.data() + q * codes_per_key; };
+
+        // q-th distinct query whose pos-th element of the bucket is deleted; pos is SERVED once looked up
+        struct variant_ref_t {
+            uint64_t home;
+            uint64_t hash;
+            uint32_t query;
+            uint32_t pos;
+        };
+        static constexpr uint32_t SERVED = UINT32_MAX;
+
+        std::vector<variant_ref_t> variants;
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> group;
+        std::vector<uint32_t> hit_queries;  // matches of all the buckets in bucket order, as (query, id) pairs
+        std::vector<uint32_t> hit_ids;
+        std::vector<uint64_t> hit_ends(m_buckets);
 
         for (uint32_t b = 0; b < m_buckets; ++b) {
-            const T* b_query = query + m_bucket_begs[b];
             const odv_index& odv_idx = m_odv_indexes[b];
+            const uint32_t beg = m_bucket_begs[b], length = m_bucket_begs[b + 1] - beg;
+            const bool has_delta = b < m_delta_tables.size() && !m_delta_tables[b].empty();
+            if (odv_idx.empty_table() && !has_delta) {
+                hit_ends[b] = hit_ids.size();
+                continue;
+            }
 
-            match_map.clear();
+            variants.clear();
+            hashes.resize(length);
+            for (uint32_t q = 0; q < distinct.size(); ++q) {
+                odv_idx.hash_variants(queries[distinct[q]] + beg, hashes.data());
+                for (uint32_t j = 0; j < length; ++j) {
+                    variants.push_back(variant_ref_t{odv_idx.get_home(hashes[j]), hashes[j], q, j});
+                }
+            }
+            // Sorted by (home, hash), so that equal variants are adjacent however many share a home. The runs of
+            // a home are short unless the table is nearly empty, so they are sorted by hash one by one.
+            parallel_radix_sort(variants, [](const variant_ref_t& v) { return v.home; }, pool.size(), &pool);
+            for (size_t r_beg = 0, r_end = 0; r_beg < variants.size(); r_beg = r_end) {
+                while (r_end < variants.size() && variants[r_end].home == variants[r_beg].home) {
+                    ++r_end;
+                }
+                if (r_end - r_beg > 1) {
+                    std::sort(variants.begin() + r_beg, variants.begin() + r_end,
+                              [](const variant_ref_t& x, const variant_ref_t& y) { return x.hash < y.hash; });
+                }
+            }
 
-            odv_idx.search(b_query, sig, [&](uint32_t id) {
-                auto it = match_map.find(id);
-                if (it == match_map.end()) {
-                    match_map.insert(std::make_pair(id, 1U));
-                } else {
-                    it->second += 1;
+            // Within a run of the same hash, each variant not served yet leads the group of the equal ones.
+            for (size_t r_beg = 0, r_end = 0; r_beg < variants.size(); r_beg = r_end) {
+                while (r_end < variants.size() && variants[r_end].home == variants[r_beg].home &&
+                       variants[r_end].hash == variants[r_beg].hash) {
+                    ++r_end;
                 }
-            });
+                for (size_t k = r_beg; k < r_end; ++k) {
+                    if (variants[k].pos == SERVED) {
+                        continue;
+                    }
+                    const variant_ref_t lead = variants[k];
+                    const T* lead_query = queries[distinct[lead.query]];
+
+                    group.clear();
+                    for (size_t l = k; l < r_end; ++l) {
+                        variant_ref_t& v = variants[l];
+                        if (v.pos == lead.pos && v.hash == lead.hash &&
+                            equal_variant(lead_query + beg, queries[distinct[v.query]] + beg, length, lead.pos)) {
+                            group.push_back(v.query);
+                            v.pos = SERVED;
+                        }
+                    }
 
-            for (const auto& kv : match_map) {
-                if (kv.second > 2) {
-                    auto it = cand_map.find(kv.first);
-                    if (it != cand_map.end()) {
-                        it->second.push_back(0);
-                    } else {
-                        cand_map.insert(std::make_pair(kv.first, std::vector<uint32_t>{0}));
+                    auto fan_out = [&](uint32_t id) {
+                        for (uint32_t q : group) {
+                            hit_queries.push_back(q);
+                            hit_ids.push_back(id);
+                        }
+                    };
+                    auto verify_fn = [&](uint32_t id, uint32_t pos) {
+                        return is_bucket_variant(lead_query, vertical_query_of(lead.query), b, id, pos);
+                    };
+                    if (!odv_idx.empty_table()) {
+                        odv_idx.search_variant(lead_query + beg, lead.hash, lead.pos, fan_out, verify_fn);
                     }
-                } else {
-                    auto it = cand_map.find(kv.first);
-                    if (it != cand_map.end()) {
-                        it->second.push_back(1);
-                    } else {
-                        cand_map.insert(std::make_pair(kv.first, std::vector<uint32_t>{1}));
+                    if (has_delta) {
+                        search_delta_variant(b, lead.hash, lead.pos, fan_out, verify_fn);
                     }
                 }
             }
+            hit_ends[b] = hit_ids.size();
         }
 
-#ifndef HMSEARCH_DISABLE_VERT
-        std::vector<uint64_t> vertical_query(m_vertical_levels);
-        for (uint32_t j = 0; j < m_vertical_levels; ++j) {
-            vertical_query[j] = make_vertical_code(query, m_length, j);
+        // Groups the matches by query with a counting sort, keeping them in bucket order
+        std::vector<uint64_t> hit_begs(distinct.size() * m_buckets + 1, 0);
+        for (uint32_t b = 0, k = 0; b < m_buckets; ++b) {
+            for (; k < hit_ends[b]; ++k) {
+                ++hit_begs[uint64_t(hit_queries[k]) * m_buckets + b + 1];
+            }
+        }
+        for (size_t k = 1; k < hit_begs.size(); ++k) {
+            hit_begs[k] += hit_begs[k - 1];
+        }
+        std::vector<uint32_t> sorted_ids(hit_ids.size());
+        {
+            std::vector<uint64_t> pos(hit_begs.begin(), hit_begs.end() - 1);
+            for (uint32_t b = 0, k = 0; b < m_buckets; ++b) {
+                for (; k < hit_ends[b]; ++k) {
+                    sorted_ids[pos[uint64_t(hit_queries[k]) * m_buckets + b]++] = hit_ids[k];
+                }
+            }
         }
-#endif
 
-        uint64_t num_candidates = 0;
+        const uint32_t num_threads = std::max<uint32_t>(1, std::min<size_t>(pool.size(), distinct.size()));
+        std::vector<uint64_t> chunk_candidates(num_threads);
+        std::vector<uint32_t>& owners = scratches[0].owners;
+        std::vector<uint64_t>& begs = scratches[0].begs;
+        std::vector<uint64_t>& ends = scratches[0].ends;
+        owners.resize(num_queries);
+        begs.resize(num_queries);
+        ends.resize(num_queries);
+
+        pool.run([&](uint32_t t) {
+            if (t >= num_threads) {
+                return;
+            }
+            search_scratch& scratch = scratches[t];
+            std::vector<uint32_t>& ids = scratch.batch_ids;
+            ids.clear();
+            const size_t q_beg = distinct.size() * t / num_threads, q_end = distinct.size() * (t + 1) / num_threads;
+            for (size_t q = q_beg; q < q_end; ++q) {
+                scratch.begin_query(size());
+                for (uint32_t b = 0; b < m_buckets; ++b) {
+                    scratch.begin_bucket();
+                    for (uint64_t k = hit_begs[q * m_buckets + b]; k < hit_begs[q * m_buckets + b + 1]; ++k) {
+                        scratch.count(sorted_ids[k]);
+                    }
+                    scratch.end_bucket(m_bucket_begs[b + 1] - m_bucket_begs[b] == 1);
+                }
+                collect_candidates(hamming_range, scratch, scratch.cand_ids);
+
+                const size_t i = distinct[q];
+                owners[i] = t;
+                begs[i] = ids.size();
+                report_candidates(queries[i], vertical_query_of(q), scratch.cand_ids.data(), scratch.cand_ids.size(),
+                                  hamming_range, [&](uint32_t id) { ids.push_back(id); });
+                ends[i] = ids.size();
+                chunk_candidates[t] += scratch.cand_ids.size();
+            }
+        });
 
-        for (const auto& kv : cand_map) {
-            uint32_t cand_id = kv.first;
-            const std::vector<uint32_t>& errors = kv.second;
-            assert(errors.size() > 0);
+        gather_results(firsts, begs, ends,
+                       [&](size_t i) -> const std::vector<uint32_t>& { return scratches[owners[i]].batch_ids; },
+                       results);
+        return std::accumulate(chunk_candidates.begin(), chunk_candidates.end(), uint64_t(0));
+    }
 
-            // enhanced filter
-            bool filtered = false;
+    // Stores the ids of the i-th query in CSR form, copying them from buffer_of(j)[begs[j]..ends[j]) for the
+    // first query j equal to it
+    template <class BufferOf>
+    static void gather_results(const std::vector<size_t>& firsts, const std::vector<uint64_t>& begs,
+                               const std::vector<uint64_t>& ends, BufferOf&& buffer_of, search_results& results) {
+        const size_t num_queries = firsts.size();
+        results.offsets.resize(num_queries + 1);
+        results.offsets[0] = 0;
+        for (size_t i = 0; i < num_queries; ++i) {
+            results.offsets[i + 1] = results.offsets[i] + ends[firsts[i]] - begs[firsts[i]];
+        }
+        results.ids.resize(results.offsets[num_queries]);
+        for (size_t i = 0; i < num_queries; ++i) {
+            const std::vector<uint32_t>& ids = buffer_of(firsts[i]);
+            std::copy(ids.begin() + begs[firsts[i]], ids.begin() + ends[firsts[i]],
+                      results.ids.begin() + results.offsets[i]);
+        }
+    }
 
-            if (hamming_range % 2 == 0) {
-                if (errors.size() < 2) {  // has less than two number
-                    if (errors[0] == 1) {
-                        filtered = true;
+    // Sets firsts[i] to the smallest index of a query equal to queries[i]. The queries are sorted by their hashes
+    // in query_hashes, and each query is compared with the distinct ones before it in its run of equal hashes.
+    template <class T>
+    void find_first_equals(const T* const* queries, size_t num_queries,
+                           std::vector<std::pair<uint64_t, size_t>>& query_hashes, std::vector<size_t>& firsts) const {
+        firsts.resize(num_queries);
+        query_hashes.resize(num_queries);
+        for (size_t i = 0; i < num_queries; ++i) {
+            query_hashes[i] = std::make_pair(sig_hash::get_instance()(queries[i], m_length), i);
+        }
+        std::sort(query_hashes.begin(), query_hashes.end());
+
+        for (size_t r_beg = 0, r_end = 0; r_beg < num_queries; r_beg = r_end) {
+            while (r_end < num_queries && query_hashes[r_end].first == query_hashes[r_beg].first) {
+                ++r_end;
+            }
+            for (size_t k = r_beg; k < r_end; ++k) {
+                const size_t i = query_hashes[k].second;
+                firsts[i] = i;
+                for (size_t l = r_beg; l < k; ++l) {
+                    const size_t d = query_hashes[l].second;
+                    if (firsts[d] == d && std::equal(queries[i], queries[i] + m_length, queries[d])) {
+                        firsts[i] = d;
+                        break;
                     }
                 }
-            } else {
-                if (errors.size() < 3) {  // has less than three number
-                    if (errors.size() == 1) {
-                        filtered = true;
-                    } else if (errors[0] == 1 && errors[1] == 1) {
-                        filtered = true;
+            }
+        }
+    }
+
+    template <class Fn>
+    uint64_t search_packed(const uint64_t* query, uint32_t hamming_range, search_scratch& scratch, Fn&& fn) const {
+        HMSEARCH_CHECK_IF(m_alphabet_size != 2, "packed queries need a binary alphabet.");
+        return search(packed_bits{query, 0}, hamming_range, scratch, fn);
+    }
+
+    template <class Key, class Fn>
+    uint64_t search(Key query, uint32_t hamming_range, search_scratch& scratch, Fn&& fn) const {
+        HMSEARCH_CHECK_IF(hamming_range > get_max_range(), "unsupported hamming range.");
+
+        scratch.begin_query(size());
+        make_vertical_query(query, scratch.vertical_query);
+
+        return with_search_key(query, scratch.vertical_query.data(), [&](auto key) {
+            for (uint32_t b = 0; b < m_buckets; ++b) {
+                search_bucket(key, scratch.vertical_query.data(), b, scratch);
+            }
+            collect_candidates(hamming_range, scratch, scratch.cand_ids);
+            report_candidates(key, scratch.vertical_query.data(), scratch.cand_ids.data(), scratch.cand_ids.size(),
+                              hamming_range, fn);
+            return uint64_t(scratch.cand_ids.size());
+        });
+    }
+
+    // Calls fn(key) with the key by which query is searched: a binary query is read from the words of its
+    // vertical query, so that the variants of every bucket are hashed and compared 64 symbols at a time.
+    template <class Key, class Fn>
+    auto with_search_key(Key query, const uint64_t* vertical_query, Fn&& fn) const {
+        if (is_binary()) {
+            return fn(packed_bits{vertical_query, 0});
+        }
+        return fn(query);
+    }
+    bool is_binary() const {
+        return m_alphabet_size <= 2;
+    }
+
+    // Searches one query on the threads of pool: the buckets are split among the threads, each counting into its
+    // own scratch, the counts are merged into scratches[0], and the candidates are split again for verification.
+    // scratches[t] is the working memory of the t-th thread. fn is called on the calling thread.
+    template <class T, class Fn>
+    uint64_t search_parallel(const T* query, uint32_t hamming_range, thread_pool& pool,
+                             std::vector<search_scratch>& scratches, Fn&& fn) const {
+        HMSEARCH_CHECK_IF(hamming_range > get_max_range(), "unsupported hamming range.");
+
+        const uint32_t num_threads = std::min(pool.size(), m_buckets);
+        search_scratch& scratch = scratches[0];
+
+        make_vertical_query(query, scratch.vertical_query);
+        const uint64_t* vertical_query = scratch.vertical_query.data();
+
+        return with_search_key(query, vertical_query, [&](auto key) {
+            pool.run([&](uint32_t t) {
+                if (t >= num_threads) {
+                    return;
+                }
+                search_scratch& local = scratches[t];
+                local.begin_query(size());
+                for (uint32_t b = m_buckets * t / num_threads; b < m_buckets * (t + 1) / num_threads; ++b) {
+                    search_bucket(key, vertical_query, b, local);
+                }
+            });
+            for (uint32_t t = 1; t < num_threads; ++t) {
+                scratch.merge_counts(scratches[t]);
+            }
+            collect_candidates(hamming_range, scratch, scratch.cand_ids);
+
+            const std::vector<uint32_t>& cand_ids = scratch.cand_ids;
+            pool.run([&](uint32_t t) {
+                search_scratch& local = scratches[t];
+                local.found_ids.clear();
+                if (t >= num_threads) {
+                    return;
+                }
+                const size_t beg = cand_ids.size() * t / num_threads, end = cand_ids.size() * (t + 1) / num_threads;
+                report_candidates(key, vertical_query, cand_ids.data() + beg, end - beg, hamming_range,
+                                  [&](uint32_t id) { local.found_ids.push_back(id); });
+            });
+            for (uint32_t t = 0; t < num_threads; ++t) {
+                for (uint32_t id : scratches[t].found_ids) {
+                    fn(id);
+                }
+            }
+            return uint64_t(cand_ids.size());
+        });
+    }
+
+    // Counts the keys matching the query in the b-th bucket
+    template <class Key>
+    void search_bucket(Key query, const uint64_t* vertical_query, uint32_t b, search_scratch& scratch) const {
+        scratch.begin_bucket();
+
+        auto count_fn = [&](uint32_t id) { scratch.count(id); };
+        auto verify_fn = [&](uint32_t id, uint32_t pos) {
+            return is_bucket_variant(query, vertical_query, b, id, pos);
+        };
+        m_odv_indexes[b].search(query + m_bucket_begs[b], scratch.odv, count_fn, verify_fn);
+        search_delta(b, scratch.odv.hashes, count_fn, verify_fn);
+
+        scratch.end_bucket(m_bucket_begs[b + 1] - m_bucket_begs[b] == 1);
+    }
+
+    // Checks if the id-th key equals query in the b-th bucket except for its pos-th element
+    template <class Key>
+    bool is_bucket_variant(Key query, const uint64_t* vertical_query, uint32_t b, uint32_t id,
+                           uint32_t pos) const {
+        if (m_vertical) {
+            return equal_vertical_except(vertical_query, id, m_bucket_begs[b], m_bucket_begs[b + 1],
+                                         m_bucket_begs[b] + pos);
+        }
+        return equal_except(query, id, m_bucket_begs[b], m_bucket_begs[b + 1], m_bucket_begs[b] + pos);
+    }
+
+    // Reports the delta keys matching a variant of the b-th bucket, given the variant hashes of the query in it
+    template <class Fn, class Verify>
+    void search_delta(uint32_t b, const std::vector<uint64_t>& hashes, Fn&& fn, Verify&& verify) const {
+        if (b >= m_delta_tables.size() || m_delta_tables[b].empty()) {
+            return;
+        }
+        for (uint32_t j = 0; j < m_bucket_begs[b + 1] - m_bucket_begs[b]; ++j) {
+            search_delta_variant(b, hashes[j], j, fn, verify);
+        }
+    }
+
+    template <class Fn, class Verify>
+    void search_delta_variant(uint32_t b, uint64_t hash, uint32_t j, Fn&& fn, Verify&& verify) const {
+        auto it = m_delta_tables[b].find(hash);
+        if (it == m_delta_tables[b].end()) {
+            return;
+        }
+        for (uint32_t id : it->second) {
+            if (verify(id, j)) {
+                fn(id);
+            }
+        }
+    }
+
+    // Lists the live keys counted by the query in scratch that pass the enhanced filter: a key with a exact buckets
+    // and c buckets of one error has at least c + 2 * (m_buckets - a - c) errors, so it is within the range only if
+    // 2 * a + c >= 2 * m_buckets - range.
+    void collect_candidates(uint32_t hamming_range, const search_scratch& scratch,
+                            std::vector<uint32_t>& cand_ids) const {
+        const uint32_t min_score = 2 * m_buckets - hamming_range;
+        cand_ids.clear();
+        scratch.for_each_score([&](uint32_t id, uint32_t score) {
+            if (score >= min_score && !is_erased(id)) {
+                cand_ids.push_back(id);
+            }
+        });
+    }
+
+    // Verifies cand_ids[0..num_cands) and reports the ids of those within the range
+    template <class Key, class Fn>
+    void report_candidates(Key query, const uint64_t* vertical_query, const uint32_t* cand_ids,
+                           size_t num_cands, uint32_t hamming_range, Fn&& fn) const {
+        if (m_vertical) {
+            verify_candidates(vertical_query, cand_ids, num_cands, hamming_range, fn);
+            return;
+        }
+        for (const uint32_t* it = cand_ids; it != cand_ids + num_cands; ++it) {
+            const uint32_t cand_id = *it;
+            uint32_t hammina_dist = 0;
+            for (uint32_t j = 0; j < m_length; ++j) {
+                if (query[j] != get_symbol(cand_id, j)) {
+                    ++hammina_dist;
+                    if (hammina_dist > hamming_range) {
+                        break;
                     }
                 }
             }
+            if (hammina_dist <= hamming_range) {
+                fn(get_external_id(cand_id));
+            }
+        }
+    }
 
-            // verification
-            if (!filtered) {
-                uint32_t hammina_dist = 0;
-#ifdef HMSEARCH_DISABLE_VERT
-                auto key = m_keys.begin() + (cand_id * m_length);
-                for (uint32_t j = 0; j < m_length; ++j) {
-                    if (query[j] != key[j]) {
-                        ++hammina_dist;
-                        if (hammina_dist > hamming_range) {
+    void prefetch_candidates(const std::vector<uint32_t>& cand_ids) const {
+        for (uint32_t id : cand_ids) {
+            if (m_vertical) {
+                __builtin_prefetch(get_vertical_codes(id));
+            } else if (id < m_num_base_keys) {
+                m_keys.prefetch(uint64_t(id) * m_length);
+            }
+        }
+    }
+
+    // Searches the queries whose indexes are given by next(i), which returns false when none is left, keeping
+    // INTERLEAVED_QUERIES of them in flight in the manner of AMAC (asynchronous memory access chaining): every step
+    // of a query ends by prefetching what its next step reads, and the other queries are stepped meanwhile so that
+    // the cache misses of different queries overlap. The steps are hashing a bucket and prefetching its home slots,
+    // locating the slots and prefetching their lists, probing the lists, and after the last bucket filtering the
+    // candidates and prefetching their keys, and verifying them. The matches of the buckets are buffered per query
+    // and counted in scratch once all the buckets are probed, since the dense counters are shared by the queries.
+    // The ids found for the i-th query are appended to ids, and done(i, beg, end) reports their range.
+    // Returns the number of verified candidates.
+    template <class T, class Next, class Done>
+    uint64_t search_interleaved(const T* const* queries, uint32_t hamming_range, search_scratch& scratch,
+                                std::vector<uint32_t>& ids, Next&& next, Done&& done) const {
+        HMSEARCH_CHECK_IF(hamming_range > get_max_range(), "unsupported hamming range.");
+
+        using state_t = query_state;
+        std::vector<state_t>& states = scratch.states;
+        states.resize(INTERLEAVED_QUERIES);
+
+        auto refill = [&](state_t& st) {
+            if (!next(st.index)) {
+                st.stage = state_t::IDLE;
+                return false;
+            }
+            st.bucket = 0;
+            st.hits.clear();
+            st.hit_ends.clear();
+            make_vertical_query(queries[st.index], st.vertical_query);
+            st.stage = state_t::PREFETCH;
+            return true;
+        };
+
+        uint32_t num_active = 0;
+        for (state_t& st : states) {
+            num_active += refill(st);
+        }
+
+        uint64_t num_candidates = 0;
+        while (num_active > 0) {
+            for (state_t& st : states) {
+                if (st.stage == state_t::IDLE) {
+                    continue;
+                }
+                with_search_key(queries[st.index], st.vertical_query.data(), [&](auto query) {
+                    const uint32_t b = st.bucket;
+                    switch (st.stage) {
+                        case state_t::PREFETCH:
+                            m_odv_indexes[b].prefetch_variants(query + m_bucket_begs[b], st.odv);
+                            st.stage = state_t::LOCATE;
+                            break;
+                        case state_t::LOCATE:
+                            m_odv_indexes[b].locate_variants(st.odv);
+                            st.stage = state_t::PROBE;
+                            break;
+                        case state_t::PROBE: {
+                            auto hit_fn = [&](uint32_t id) { st.hits.push_back(id); };
+                            auto verify_fn = [&](uint32_t id, uint32_t pos) {
+                                return is_bucket_variant(query, st.vertical_query.data(), b, id, pos);
+                            };
+                            m_odv_indexes[b].report_variants(query + m_bucket_begs[b], st.odv, hit_fn, verify_fn);
+                            search_delta(b, st.odv.hashes, hit_fn, verify_fn);
+                            st.hit_ends.push_back(st.hits.size());
+                            st.bucket += 1;
+                            st.stage = st.bucket < m_buckets ? state_t::PREFETCH : state_t::FILTER;
+                            break;
+                        }
+                        case state_t::FILTER: {
+                            scratch.begin_query(size());
+                            uint64_t k = 0;
+                            for (uint32_t bb = 0; bb < m_buckets; ++bb) {
+                                scratch.begin_bucket();
+                                for (; k < st.hit_ends[bb]; ++k) {
+                                    scratch.count(st.hits[k]);
+                                }
+                                scratch.end_bucket(m_bucket_begs[bb + 1] - m_bucket_begs[bb] == 1);
+                            }
+                            collect_candidates(hamming_range, scratch, st.cand_ids);
+                            prefetch_candidates(st.cand_ids);
+                            st.stage = state_t::VERIFY;
+                            break;
+                        }
+                        case state_t::VERIFY: {
+                            const uint64_t beg = ids.size();
+                            report_candidates(query, st.vertical_query.data(), st.cand_ids.data(), st.cand_ids.size(),
+                                              hamming_range, [&](uint32_t id) { ids.push_back(id); });
+                            done(st.index, beg, ids.size());
+                            num_candidates += st.cand_ids.size();
+                            num_active -= !refill(st);
                             break;
                         }
+                        case state_t::IDLE:
+                            break;
                     }
+                });
+            }
+        }
+        return num_candidates;
+    }
+
+    // Checks if query and the id-th key are equal in [beg, end) except for the skip-th element
+    template <class Key>
+    bool equal_except(Key query, uint32_t id, uint32_t beg, uint32_t end, uint32_t skip) const {
+        for (uint32_t j = beg; j < end; ++j) {
+            if (j != skip && query[j] != get_symbol(id, j)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t get_symbol(uint32_t id, uint32_t j) const {
+        if (id < m_num_base_keys) {
+            return m_keys[uint64_t(id) * m_length + j];
+        }
+        return m_delta_keys[uint64_t(id - m_num_base_keys) * m_length + j];
+    }
+
+    // Checks if the vertical codes of the query and the id-th key are equal in [beg, end) except for the skip-th bit
+    bool equal_vertical_except(const uint64_t* vertical_query, uint32_t id, uint32_t beg, uint32_t end,
+                               uint32_t skip) const {
+        for (uint32_t w = beg / 64; w * 64 < end; ++w) {
+            const uint32_t w_beg = std::max(beg, w * 64) - w * 64;
+            const uint32_t w_end = std::min(end, w * 64 + 64) - w * 64;
+            uint64_t mask = sdsl::bits::lo_set[w_end - w_beg] << w_beg;
+            if (skip / 64 == w) {
+                mask &= ~(1ULL << (skip % 64));
+            }
+            for (uint32_t l = 0; l < m_vertical_levels; ++l) {
+                const uint32_t k = w * m_vertical_levels + l;
+                if ((get_vertical_code(id, k) ^ vertical_query[k]) & mask) {
+                    return false;
                 }
-#else
+            }
+        }
+        return true;
+    }
+
+    // The k-th code of a key is the level (k % m_vertical_levels) of its word (k / m_vertical_levels).
+    uint64_t get_vertical_code(uint32_t id, uint32_t k) const {
+        return get_vertical_codes(id)[k];
+    }
+    const uint64_t* get_vertical_codes(uint32_t id) const {
+        if (id < m_num_base_keys) {
+            return m_vertical_keys.data() + uint64_t(id) * get_vertical_codes_per_key();
+        }
+        return m_delta_vertical_keys.data() + uint64_t(id - m_num_base_keys) * get_vertical_codes_per_key();
+    }
+
+    // Reports the candidates within range. Groups of candidates are verified in SIMD lanes if available, and a
+    // group is abandoned as soon as all its lanes exceed range.
+    template <class Fn>
+    void verify_candidates(const uint64_t* vertical_query, const uint32_t* cand_ids, size_t num_cands, uint32_t range,
+                           Fn&& fn) const {
+        size_t i = 0;
+#if defined(HMSEARCH_USE_AVX512)
+        for (; i + 8 <= num_cands; i += 8) {
+            verify_lanes_avx512(vertical_query, &cand_ids[i], range, fn);
+        }
+#elif defined(HMSEARCH_USE_AVX2)
+        for (; i + 4 <= num_cands; i += 4) {
+            verify_lanes_avx2(vertical_query, &cand_ids[i], range, fn);
+        }
+#endif
+        for (; i < num_cands; ++i) {
+            const uint64_t* codes = get_vertical_codes(cand_ids[i]);
+            uint32_t hammina_dist = 0;
+            for (uint32_t w = 0; w < m_vertical_words && hammina_dist <= range; ++w) {
+                const uint32_t dist_beg = hammina_dist;
                 uint64_t cumdiff = 0;
-                uint64_t beg = cand_id * m_vertical_levels;
-                for (uint32_t j = 0; j < m_vertical_levels; ++j) {
-                    uint64_t diff = m_vertical_keys[beg + j] ^ vertical_query[j];
-                    cumdiff |= diff;
-                    hammina_dist = sdsl::bits::cnt(cumdiff);
-                    if (hammina_dist > hamming_range) {
+                for (uint32_t l = 0; l < m_vertical_levels; ++l) {
+                    const uint32_t k = w * m_vertical_levels + l;
+                    cumdiff |= codes[k] ^ vertical_query[k];
+                    hammina_dist = dist_beg + sdsl::bits::cnt(cumdiff);
+                    if (hammina_dist > range) {
                         break;
                     }
                 }
+            }
+            if (hammina_dist <= range) {
+                fn(get_external_id(cand_ids[i]));
+            }
+        }
+    }
+
+#if defined(HMSEARCH_USE_AVX512)
+    template <class Fn>
+    void verify_lanes_avx512(const uint64_t* vertical_query, const uint32_t* ids, uint32_t range,
+                             Fn&& fn) const {
+        const uint64_t* codes[8];
+        for (uint32_t i = 0; i < 8; ++i) {
+            codes[i] = get_vertical_codes(ids[i]);
+        }
+        const __m512i limit = _mm512_set1_epi64(range);
+        __m512i dist = _mm512_setzero_si512();
+        for (uint32_t w = 0; w < m_vertical_words; ++w) {
+            __m512i cumdiff = _mm512_setzero_si512();
+            __m512i word_dist = dist;
+            for (uint32_t l = 0; l < m_vertical_levels; ++l) {
+                const uint32_t k = w * m_vertical_levels + l;
+                const __m512i lane_codes = _mm512_set_epi64(codes[7][k], codes[6][k], codes[5][k], codes[4][k],
+                                                            codes[3][k], codes[2][k], codes[1][k], codes[0][k]);
+                cumdiff = _mm512_or_si512(cumdiff, _mm512_xor_si512(lane_codes, _mm512_set1_epi64(vertical_query[k])));
+                word_dist = _mm512_add_epi64(dist, _mm512_popcnt_epi64(cumdiff));
+                if (_mm512_cmpgt_epu64_mask(word_dist, limit) == 0xFF) {
+                    return;
+                }
+            }
+            dist = word_dist;
+        }
+        const __mmask8 within = ~_mm512_cmpgt_epu64_mask(dist, limit);
+        for (uint32_t i = 0; i < 8; ++i) {
+            if ((within >> i) & 1) {
+                fn(get_external_id(ids[i]));
+            }
+        }
+    }
+#elif defined(HMSEARCH_USE_AVX2)
+    template <class Fn>
+    void verify_lanes_avx2(const uint64_t* vertical_query, const uint32_t* ids, uint32_t range,
+                           Fn&& fn) const {
+        const uint64_t* codes[4];
+        for (uint32_t i = 0; i < 4; ++i) {
+            codes[i] = get_vertical_codes(ids[i]);
+        }
+        const __m256i limit = _mm256_set1_epi64x(range);
+        __m256i dist = _mm256_setzero_si256();
+        for (uint32_t w = 0; w < m_vertical_words; ++w) {
+            __m256i cumdiff = _mm256_setzero_si256();
+            __m256i word_dist = dist;
+            for (uint32_t l = 0; l < m_vertical_levels; ++l) {
+                const uint32_t k = w * m_vertical_levels + l;
+                const __m256i lane_codes = _mm256_set_epi64x(codes[3][k], codes[2][k], codes[1][k], codes[0][k]);
+                cumdiff = _mm256_or_si256(cumdiff, _mm256_xor_si256(lane_codes, _mm256_set1_epi64x(vertical_query[k])));
+                word_dist = _mm256_add_epi64(dist, popcount_epi64(cumdiff));
+                if (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(word_dist, limit))) == 0xF) {
+                    return;
+                }
+            }
+            dist = word_dist;
+        }
+        const int exceeded = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(dist, limit)));
+        for (uint32_t i = 0; i < 4; ++i) {
+            if (!((exceeded >> i) & 1)) {
+                fn(get_external_id(ids[i]));
+            }
+        }
+    }
 #endif
-                if (hammina_dist <= hamming_range) {
-                    fn(cand_id);
+
+    uint32_t get_vertical_codes_per_key() const {
+        return m_vertical_levels * m_vertical_words;
+    }
+
+    template <class T>
+    void make_vertical_codes(const T* key, uint64_t* codes) const {
+        for (uint32_t w = 0; w < m_vertical_words; ++w) {
+            const uint32_t beg = w * 64;
+            for (uint32_t l = 0; l < m_vertical_levels; ++l) {
+                codes[w * m_vertical_levels + l] = make_vertical_code(key + beg, std::min(m_length - beg, 64U), l);
+            }
+        }
+    }
+
+    // Makes the vertical codes of the query if the keys are stored vertically, and always for a binary query,
+    // whose single level is the query packed into words
+    template <class T>
+    void make_vertical_query(const T* query, std::vector<uint64_t>& vertical_query) const {
+        if (!m_vertical && !is_binary()) {
+            return;
+        }
+        vertical_query.resize(get_vertical_codes_per_key());
+        make_vertical_codes(query, vertical_query.data());
+    }
+    void make_vertical_query(packed_bits query, std::vector<uint64_t>& vertical_query) const {
+        assert(is_binary() && m_vertical_levels == 1);
+        vertical_query.resize(m_vertical_words);
+        for (uint32_t w = 0; w < m_vertical_words; ++w) {
+            vertical_query[w] = query.get_word(w * 64, std::min(m_length - w * 64, 64U));
+        }
+    }
+
+    // Registers the variants of key in every bucket of the delta segment.
+    template <class T>
+    void insert_delta_variants(const T* key, uint32_t id) {
+        std::vector<uint64_t> hashes;
+        for (uint32_t b = 0; b < m_buckets; ++b) {
+            const uint32_t bucket_length = m_bucket_begs[b + 1] - m_bucket_begs[b];
+            hashes.resize(bucket_length);
+            m_odv_indexes[b].hash_variants(key + m_bucket_begs[b], hashes.data());
+            for (uint32_t j = 0; j < bucket_length; ++j) {
+                std::vector<uint32_t>& ids = m_delta_tables[b][hashes[j]];
+                // Two variants of one key can only share a hash by collision; list the id once.
+                if (ids.empty() || ids.back() != id) {
+                    ids.push_back(id);
                 }
+            }
+        }
+    }
+
+    // Rebuilds the delta tables from the delta key codes, whose ids start from num_base_keys.
+    void reinsert_delta(uint32_t num_base_keys) {
+        m_num_base_keys = num_base_keys;
+        m_delta_tables = std::vector<std::unordered_map<uint64_t, std::vector<uint32_t>>>(m_buckets);
+        std::vector<uint32_t> key(m_length);
+        for (uint32_t id = m_num_base_keys; id < size(); ++id) {
+            restore_key(id, key.data());
+            insert_delta_variants(key.data(), id);
+        }
+    }
 
-                ++num_candidates;
+    // Restores the symbols of the pos-th stored key from the key codes.
+    template <class T>
+    void restore_key(uint32_t pos, T* out) const {
+        if (!m_vertical) {
+            for (uint32_t j = 0; j < m_length; ++j) {
+                out[j] = static_cast<T>(get_symbol(pos, j));
+            }
+            return;
+        }
+        std::fill(out, out + m_length, T(0));
+        for (uint32_t w = 0; w < m_vertical_words; ++w) {
+            const uint32_t beg = w * 64;
+            for (uint32_t l = 0; l < m_vertical_levels; ++l) {
+                const uint64_t code = get_vertical_code(pos, w * m_vertical_levels + l);
+                for (uint32_t j = 0; j < std::min(m_length - beg, 64U); ++j) {
+                    out[beg + j] |= static_cast<T>(((code >> j) & 1ULL) << l);
+                }
             }
         }
+    }
 
-        return num_candidates;
+    bool is_erased(uint32_t pos) const {
+        return pos / 64 < m_tombstones.size() && ((m_tombstones[pos / 64] >> (pos % 64)) & 1ULL);
+    }
+
+    uint32_t get_external_id(uint32_t pos) const {
+        return m_ext_ids.empty() ? pos : m_ext_ids[pos];
+    }
+
+    // Finds the position of the key of id among num_keys keys mapped by ext_ids
+    static bool find_position(const std::vector<uint32_t>& ext_ids, uint32_t num_keys, uint32_t id, uint32_t& pos) {
+        if (ext_ids.empty()) {
+            pos = id;
+            return id < num_keys;
+        }
+        auto it = std::lower_bound(ext_ids.begin(), ext_ids.end(), id);
+        pos = static_cast<uint32_t>(it - ext_ids.begin());
+        return it != ext_ids.end() && *it == id;
+    }
+
+    // Restores the live keys and rebuilds the index from them on a background thread. Delta keys and the ids
+    // are taken here since they may change during the merge, while the base key codes stay intact until
+    // finish_merge().
+    template <class T>
+    void launch_merge(uint32_t num_threads) {
+        const uint32_t num_keys = size();
+
+        std::vector<uint32_t> kept;
+        kept.reserve(num_keys - m_num_erased);
+        for (uint32_t pos = 0; pos < num_keys; ++pos) {
+            if (!is_erased(pos)) {
+                kept.push_back(pos);
+            }
+        }
+
+        std::vector<uint32_t> ext_ids;
+        if (kept.size() != num_keys || !m_ext_ids.empty()) {
+            ext_ids.resize(kept.size());
+            for (uint32_t k = 0; k < kept.size(); ++k) {
+                ext_ids[k] = get_external_id(kept[k]);
+            }
+        }
+
+        std::vector<T> keys_buf(uint64_t(kept.size()) * m_length);
+        for (uint32_t k = 0; k < kept.size(); ++k) {
+            if (kept[k] >= m_num_base_keys) {
+                restore_key(kept[k], &keys_buf[uint64_t(k) * m_length]);
+            }
+        }
+        m_num_merging_keys = num_keys;
+
+        auto task = [this, num_threads, kept = std::move(kept), ext_ids = std::move(ext_ids),
+                     keys_buf = std::move(keys_buf)]() mutable {
+            std::vector<const T*> keys(kept.size());
+            for (uint32_t k = 0; k < kept.size(); ++k) {
+                keys[k] = &keys_buf[uint64_t(k) * m_length];
+                if (kept[k] < m_num_base_keys) {
+                    restore_key(kept[k], &keys_buf[uint64_t(k) * m_length]);
+                }
+            }
+            build_config config = m_odv_indexes[0].get_config();
+            config.keys = get_key_layout();
+            auto merged = std::make_unique<hm_index>();
+            merged->build(keys, m_length, m_alphabet_size, m_buckets, num_threads, config);
+            merged->m_ext_ids = std::move(ext_ids);
+            return merged;
+        };
+        m_merge = std::async(std::launch::async, std::move(task));
     }
 
-  private:
     template <class T>
     static uint64_t make_vertical_code(const T* key, uint32_t length, uint32_t level) {
         assert(length <= 64);
@@ -488,4 +3051,57 @@ class hm_index {
     }
 };
 
-}  // namespace hmsearch
\ No newline at end of file
+// Searches a const hm_index with working memory owned by the searcher and reused across calls. Once the buffers
+// have grown to fit the index and the batches, search and search_batch perform no heap allocations besides those
+// of fn and of growing the results. A searcher serves one thread at a time, while any number of searchers may
+// search the same index from different threads as long as the index is not modified meanwhile. A searcher made
+// with num_threads > 1 keeps that many threads alive, each with its own working memory, and searches batches on
+// all of them or splits single queries among them.
+class hm_searcher {
+  public:
+    explicit hm_searcher(const hm_index& index, uint32_t num_threads = 1)
+        : m_index(index), m_pool(num_threads), m_scratches(m_pool.size()), m_workers(m_pool.size()) {}
+
+    const hm_index& get_index() const {
+        return m_index;
+    }
+    uint32_t get_num_threads() const {
+        return m_pool.size();
+    }
+
+    template <class T, class Fn>
+    uint64_t search(const T* query, uint32_t hamming_range, Fn&& fn) {
+        return m_index.search(query, hamming_range, m_scratches[0], fn);
+    }
+
+    // Splits the buckets and the candidates of the query among the threads of the searcher to cut its latency
+    template <class T, class Fn>
+    uint64_t search_parallel(const T* query, uint32_t hamming_range, Fn&& fn) {
+        return m_index.search_parallel(query, hamming_range, m_pool, m_scratches, fn);
+    }
+
+    template <class Fn>
+    uint64_t search_packed(const uint64_t* query, uint32_t hamming_range, Fn&& fn) {
+        return m_index.search_packed(query, hamming_range, m_scratches[0], fn);
+    }
+
+    template <class T>
+    uint64_t search_batch(const T* const* queries, size_t num_queries, uint32_t hamming_range,
+                          search_results& results) {
+        return m_index.search_batch(queries, num_queries, hamming_range, m_pool, m_scratches, m_workers, results);
+    }
+
+    template <class T>
+    uint64_t search_batch_join(const T* const* queries, size_t num_queries, uint32_t hamming_range,
+                               search_results& results) {
+        return m_index.search_batch_join(queries, num_queries, hamming_range, m_pool, m_scratches, results);
+    }
+
+  private:
+    const hm_index& m_index;
+    thread_pool m_pool;
+    std::vector<hm_index::search_scratch> m_scratches;  // for the t-th thread of m_pool
+    hm_index::batch_workers m_workers;                  // for the t-th thread of parallel batches
+};
+
+}  // namespace hmsearch
@@ -141,6 +141,19 @@ int main(int argc, char* argv[]) {
     p.add<uint32_t>("alphabet_size", 'a', "alphabet size", false, 256);
     p.add<std::string>("hamming_ranges", 'r', "hamming ranges (min:max:step)", false, "0:10:2");
     p.add<bool>("enable_test", 't', "enable test", false, false);
+    p.add<uint32_t>("threads", 'T', "number of threads", false, 1);
+    p.add<bool>("signature_free", 'f', "verify table hits against keys instead of storing signatures", false, false);
+    p.add<bool>("cuckoo", 'c', "use bucketized cuckoo hash tables", false, false);
+    p.add<bool>("compress_postings", 'z', "compress posting lists", false, false);
+    p.add<uint32_t>("insert_percent", 'i', "percentage of keys inserted after construction", false, 0);
+    p.add<uint32_t>("erase_percent", 'e', "percentage of keys erased after construction", false, 0);
+    p.add<bool>("batch", 'b', "search queries in a batch, on the given number of threads", false, false);
+    p.add<bool>("join", 'j', "search batches as hash joins against the buckets", false, false);
+    p.add<bool>("single_index", 's', "search all the ranges with one index built for the maximum range", false, false);
+    p.add<std::string>("index_fn", 'x', "file to which the index is written and from which it is mapped", false, "");
+    p.add<bool>("merge", 'm', "merge updates into the base, half of them during the merge", false, false);
+    p.add<std::string>("key_layout", 'v', "layout of the key codes (auto, horizontal or vertical)", false, "auto");
+    p.add<bool>("packed", 'p', "search binary queries packed into 64-bit words (alphabet size 2)", false, false);
     p.parse_check(argc, argv);
 
     auto key_fn = p.get<std::string>("key_fn");
@@ -149,6 +162,38 @@ int main(int argc, char* argv[]) {
     auto alphabet_size = p.get<uint32_t>("alphabet_size");
     auto hamming_ranges = p.get<std::string>("hamming_ranges");
     auto enable_test = p.get<bool>("enable_test");
+    auto threads = p.get<uint32_t>("threads");
+    auto insert_percent = p.get<uint32_t>("insert_percent");
+    auto erase_percent = p.get<uint32_t>("erase_percent");
+    auto merge = p.get<bool>("merge");
+    auto index_fn = p.get<std::string>("index_fn");
+    auto single_index = p.get<bool>("single_index");
+    auto batch = p.get<bool>("batch");
+    auto join = p.get<bool>("join");
+    auto packed = p.get<bool>("packed");
+
+    if (packed && alphabet_size != 2) {
+        std::cerr << "error: packed queries need alphabet size 2" << std::endl;
+        exit(1);
+    }
+
+    auto is_erased = [&](size_t i) { return (i * 37) % 100 < erase_percent; };
+
+    hmsearch::build_config config;
+    config.store_signatures = !p.get<bool>("signature_free");
+    config.compress_postings = p.get<bool>("compress_postings");
+    if (p.get<bool>("cuckoo")) {
+        config.layout = hmsearch::table_layout::BUCKETIZED_CUCKOO;
+    }
+    const auto key_layout = p.get<std::string>("key_layout");
+    if (key_layout == "horizontal") {
+        config.keys = hmsearch::key_layout::HORIZONTAL;
+    } else if (key_layout == "vertical") {
+        config.keys = hmsearch::key_layout::VERTICAL;
+    } else if (key_layout != "auto") {
+        std::cerr << "error: invalid key layout " << key_layout << std::endl;
+        exit(1);
+    }
 
     std::vector<uint8_t> keys_buf;
     std::vector<const uint8_t*> keys;
@@ -176,13 +221,26 @@ int main(int argc, char* argv[]) {
         std::cout << "--> " << queries.size() << " queries" << std::endl;
     }
 
+    // The j-th query packed into packed_queries[j * words_per_query..]
+    const uint32_t words_per_query = (length + 63) / 64;
+    std::vector<uint64_t> packed_queries;
+    if (packed) {
+        packed_queries.resize(queries.size() * words_per_query);
+        for (size_t j = 0; j < queries.size(); ++j) {
+            for (uint32_t i = 0; i < length; ++i) {
+                packed_queries[j * words_per_query + i / 64] |= uint64_t(queries[j][i]) << (i % 64);
+            }
+        }
+    }
+
     uint32_t min_range, max_range, range_step;
     std::tie(min_range, max_range, range_step) = parse_range(hamming_ranges);
 
     std::unique_ptr<hmsearch::hm_index> index;
 
     for (uint32_t hamming_range = min_range; hamming_range <= max_range; hamming_range += range_step) {
-        const uint32_t proper_buckets = hmsearch::hm_index::get_proper_buckets(hamming_range);
+        const uint32_t proper_buckets =
+            hmsearch::hm_index::get_proper_buckets(single_index ? max_range : hamming_range);
 
         std::cout << std::endl;
         std::cout << "[analyzing] " << hamming_range << " range; " << proper_buckets << " buckets" << std::endl;
@@ -191,14 +249,56 @@ int main(int argc, char* argv[]) {
             std::cout << "Constructing index..." << std::endl;
             {
                 timer t;
+                const size_t num_inserted = keys.size() * std::min(insert_percent, 100U) / 100;
+                const std::vector<const uint8_t*> base_keys(keys.begin(), keys.end() - num_inserted);
+
                 index = std::make_unique<hmsearch::hm_index>();
-                index->build(keys, length, alphabet_size, hmsearch::hm_index::get_proper_buckets(hamming_range));
+                index->build(base_keys, length, alphabet_size, proper_buckets, threads, config);
                 std::cout << "--> construction time: " << t.get<std::chrono::seconds>() << " sec" << std::endl;
 
+                if (num_inserted > 0 || erase_percent > 0) {
+                    timer t_upd;
+                    size_t num_erased = 0;
+                    auto erase_keys = [&](size_t end, size_t step) {
+                        for (size_t i = 0; i < end; i += step) {
+                            if (is_erased(i) && index->erase(i)) {
+                                ++num_erased;
+                            }
+                        }
+                    };
+                    for (size_t i = base_keys.size(); i < keys.size(); ++i) {
+                        if (merge && i == keys.size() - num_inserted / 2) {
+                            erase_keys(i, 2);
+                            index->start_merge(threads);
+                        }
+                        index->insert(keys[i]);
+                    }
+                    erase_keys(keys.size(), 1);
+                    if (merge && !index->finish_merge()) {
+                        index->merge(threads);
+                    }
+                    std::cout << "--> update time: " << t_upd.get<std::chrono::milliseconds>() << " ms for "
+                              << num_inserted << " insertions and " << num_erased << " erasures" << std::endl;
+                }
+
+                const bool vertical = index->get_key_layout() == hmsearch::key_layout::VERTICAL;
+                std::cout << "--> key layout: " << (vertical ? "vertical" : "horizontal") << std::endl;
+
                 uint64_t memory_usage = sdsl::size_in_bytes(*index.get());
                 std::cout << "--> memory usage: " << memory_usage << " bytes; "  //
                           << memory_usage / (1024.0 * 1024.0) << " MiB" << std::endl;
             }
+
+            if (!index_fn.empty()) {
+                {
+                    std::ofstream ofs(index_fn, std::ios::binary);
+                    index->serialize(ofs);
+                }
+                timer t;
+                index = std::make_unique<hmsearch::hm_index>();
+                index->map(index_fn);
+                std::cout << "--> mapping time: " << t.get<std::chrono::microseconds>() << " us" << std::endl;
+            }
         }
 
         if (enable_test) {
@@ -210,6 +310,16 @@ int main(int argc, char* argv[]) {
             solutions.reserve(1U << 10);
             true_solutions.reserve(1U << 10);
 
+            hmsearch::hm_searcher searcher(*index, threads);
+            hmsearch::search_results results;
+            if (batch) {
+                if (join) {
+                    searcher.search_batch_join(queries.data(), queries.size(), hamming_range, results);
+                } else {
+                    searcher.search_batch(queries.data(), queries.size(), hamming_range, results);
+                }
+            }
+
 #ifdef HMSEARCH_PRINT_PROGRESS
             std::cerr << " #" << std::flush;
             hmsearch::progress_printer p(queries.size() - 1);
@@ -219,9 +329,24 @@ int main(int argc, char* argv[]) {
                 solutions.clear();
                 true_solutions.clear();
 
-                index->search(queries[j], hamming_range, [&](uint32_t id) { solutions.push_back(id); });
+                if (batch) {
+                    solutions.assign(results.ids.begin() + results.offsets[j],
+                                     results.ids.begin() + results.offsets[j + 1]);
+                } else {
+                    auto fn = [&](uint32_t id) { solutions.push_back(id); };
+                    if (packed) {
+                        searcher.search_packed(&packed_queries[j * words_per_query], hamming_range, fn);
+                    } else if (threads > 1) {
+                        searcher.search_parallel(queries[j], hamming_range, fn);
+                    } else {
+                        searcher.search(queries[j], hamming_range, fn);
+                    }
+                }
 
                 for (uint32_t i = 0; i < keys.size(); ++i) {
+                    if (is_erased(i)) {
+                        continue;
+                    }
                     uint32_t hamming_dist = compute_hamming_distance(keys[i], queries[j], length, hamming_range);
                     if (hamming_dist <= hamming_range) {
                         true_solutions.push_back(i);
@@ -266,15 +391,30 @@ int main(int argc, char* argv[]) {
             std::vector<uint32_t> solutions;
             solutions.reserve(1U << 10);
 
+            hmsearch::hm_searcher searcher(*index, threads);
+            hmsearch::search_results results;
+
             uint64_t sum_candidates = 0;
 
             timer t;
-            for (uint32_t j = 0; j < queries.size(); ++j) {
-                sum_candidates += index->search(queries[j], hamming_range,  //
-                                                [&](uint32_t id) { solutions.push_back(id); });
+            if (batch) {
+                sum_candidates =
+                    join ? searcher.search_batch_join(queries.data(), queries.size(), hamming_range, results)
+                         : searcher.search_batch(queries.data(), queries.size(), hamming_range, results);
+            } else {
+                for (uint32_t j = 0; j < queries.size(); ++j) {
+                    auto fn = [&](uint32_t id) { solutions.push_back(id); };
+                    if (packed) {
+                        sum_candidates +=
+                            searcher.search_packed(&packed_queries[j * words_per_query], hamming_range, fn);
+                    } else {
+                        sum_candidates += threads > 1 ? searcher.search_parallel(queries[j], hamming_range, fn)
+                                                      : searcher.search(queries[j], hamming_range, fn);
+                    }
+                }
             }
             double elapsed_ms = t.get<std::chrono::milliseconds>() / queries.size();
-            double num_solutions = double(solutions.size()) / queries.size();
+            double num_solutions = double(batch ? results.ids.size() : solutions.size()) / queries.size();
             double num_candidates = double(sum_candidates) / queries.size();
 
             std::cout << "--> " << elapsed_ms << " ms_per_query" << std::endl;